@@ -9,21 +9,48 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+/* Scans for the end of runs of bytes use SSE2 where it is there */
+#if defined(__SSE2__) && defined(__GNUC__)
+#define SPIKE_SIMD
+#include <emmintrin.h>
+#endif
+
 /* =============== Defines =============== */
 
 #define SPIKE_VERSION "0.0.1"
 #define SPIKE_TAB_STOP 8
 #define SPIKE_QUIT_TIMES 3
+#define SPIKE_MAX_REPEAT 100000000    /* Largest Ctrl-U repeat count */
+#define SPIKE_UNDO_MAX (64 * 1024 * 1024)    /* Max bytes kept in the undo log */
+#define SPIKE_KILL_RING 16            /* Number of kills that are remembered */
+#define SPIKE_SPAN_ROWS 64            /* Deletes of this many rows keep them in a span */
+#define SPIKE_MAX_THREADS 16          /* Most threads a batch operation is spread over */
+#define SPIKE_WORD_MAX 64             /* Longest word kept in the word index */
+#define SPIKE_COMPLETIONS 8           /* Candidates offered by a completion */
+#define SPIKE_CACHE_MAX (64 * 1024 * 1024)    /* Render bytes kept by inactive buffers */
+#define SPIKE_MAX_LISTENERS 8         /* Most subsystems that can listen for row changes */
+#define SPIKE_SHIFT_LOG 4096          /* Inserts and deletes kept for anchors to catch up on */
+#define SPIKE_JUMPS 100               /* Positions that can be jumped back to */
+#define SPIKE_PROFILE_FRAMES 256      /* Frames the profile percentiles are taken over */
+#define SPIKE_LATENCY_SUB 32          /* Latency buckets per power of two, about 3% apart */
+#define SPIKE_LATENCY_BUCKETS (SPIKE_LATENCY_SUB * 42)    /* Up to 2^46 ns, about 19 hours */
+#define SPIKE_LATENCY_PENDING 256     /* Keys read before a frame that room is first made for */
+#define SPIKE_TRACE_EVENTS 65536      /* Trace events kept per thread, a power of two */
+#define SPIKE_TRACE_THREADS (SPIKE_MAX_THREADS + 8)    /* Threads that can be traced at once */
+#define SPIKE_TRACE_DEPTH 32          /* Nested spans a thread can have open */
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -39,7 +66,29 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  WORD_LEFT,            /* Alt-b or Ctrl-Left */
+  WORD_RIGHT,           /* Alt-f or Ctrl-Right */
+  PARA_UP,              /* Alt-{ or Ctrl-Up */
+  PARA_DOWN             /* Alt-} or Ctrl-Down */
+};
+
+/* Stages of making a frame that are timed */
+enum editorStage {
+  STAGE_KEY = 0,        /* Handling the keys read since the last frame */
+  STAGE_SCROLL,         /* editorScroll() */
+  STAGE_DRAW,           /* editorDrawRows() of every view */
+  STAGE_WRITE,          /* Writing the frame to the terminal */
+  STAGE_BACKGROUND,     /* Pool workers and the word index thread */
+  STAGE_COUNT
+};
+
+/* Classes of bytes in charClass[], which are bits so that a scan
+ * can skip over more than one class */
+enum editorCharClass {
+  CLASS_BLANK = 1,
+  CLASS_WORD = 2,
+  CLASS_PUNCT = 4
 };
 
 /* Contains the possible values that the hl (highlight)
@@ -50,6 +99,65 @@ enum editorHighlight {
   HL_MATCH
 };
 
+/* Types of records in the undo log. Every record describes one 
+ * change to the rows and has an exact inverse (INS <-> DEL and 
+ * SPLIT <-> JOIN) */
+enum undoType {
+  UNDO_INS_CHARS = 1,   /* len bytes inserted into a row at col */
+  UNDO_DEL_CHARS,       /* len bytes deleted from a row at col */
+  UNDO_INS_ROWS,        /* n rows inserted at row, data is the rows joined by '\n' */
+  UNDO_DEL_ROWS,        /* n rows deleted at row, data is the rows joined by '\n' */
+  UNDO_SPLIT,           /* A row split in two at col */
+  UNDO_JOIN,            /* A row joined with the next one, which started at col */
+  UNDO_INS_SPAN,        /* n rows of a span inserted at row, data is an undoSpanRef */
+  UNDO_DEL_SPAN,        /* n rows deleted at row into a span, data is an undoSpanRef */
+  UNDO_INS_RECT,        /* Bytes inserted into n rows from row on, data is a rectangle blob */
+  UNDO_DEL_RECT,        /* Bytes deleted from n rows from row on, data is a rectangle blob */
+  UNDO_PERMUTE,         /* n rows from row on reordered, data is the permutation */
+  UNDO_UNPERMUTE,       /* The inverse of the permutation in data was applied */
+  UNDO_SWAP_SPAN        /* The chars of n rows swapped with a span's, data is an
+			   undoSpanRef followed by the n row numbers */
+};
+
+/* Kinds of changes to the rows that listeners are told about */
+enum editorChange {
+  CHANGE_INSERT = 1,    /* n rows were inserted at at */
+  CHANGE_DELETE,        /* n rows were deleted from at on */
+  CHANGE_MODIFY,        /* The contents of n rows from at on changed */
+  CHANGE_PERMUTE        /* n rows from at on were reordered, see L.moved */
+};
+
+/* Parts of the editor that allocations are counted against */
+enum editorAllocTag {
+  ALLOC_OTHER = 0,
+  ALLOC_RENDER,         /* Render and highlight arrays */
+  ALLOC_ROWS,           /* The row array and the chars of rows */
+  ALLOC_INDEX,          /* Line offsets */
+  ALLOC_SPANS,
+  ALLOC_WORDS,          /* Word index and completion */
+  ALLOC_EDIT,           /* Editing commands, cursors, anchors and folds */
+  ALLOC_UNDO,
+  ALLOC_FILE,
+  ALLOC_BUFFERS,
+  ALLOC_FIND,
+  ALLOC_ABUF,           /* Frames being written to the terminal */
+  ALLOC_SCREEN,         /* Views */
+  ALLOC_COUNT
+};
+
+/* Building with -DSPIKE_ALLOC_STATS (make alloc-stats) counts the
+ * allocations of each part of the editor. malloc(), realloc(), 
+ * free() and strdup() are then routed through wrappers that count
+ * against ALLOC_TAG, which each section sets for the code in it */
+#define ALLOC_TAG ALLOC_OTHER
+#ifdef SPIKE_ALLOC_STATS
+#define malloc(n) editorTrackedRealloc(ALLOC_TAG, NULL, (n))
+#define realloc(p, n) editorTrackedRealloc(ALLOC_TAG, (p), (n))
+#define free(p) editorTrackedFree(p)
+#define calloc(n, size) editorTrackedCalloc(ALLOC_TAG, (n), (size))
+#define strdup(s) editorTrackedStrdup(ALLOC_TAG, (s))
+#endif
+
 /* =============== Data =============== */
 
 /* Data type for storing a row of text in the editor. 
@@ -59,10 +167,168 @@ typedef struct erow {
   int size;
   int rsize;
   char *chars;          /* Array of chars */
-  char *render;
+  char *render;         /* NULL until the row is first drawn or searched */
   unsigned char *hl;    /* highlight, array of unsigned chars */
+  struct espan *span;   /* Span that owns chars, if chars is shared */
+  unsigned int gen;     /* Generation of the buffer when the row last changed */
+  int indent;           /* Columns of leading whitespace, -1 if blank */
+  unsigned int indentgen;   /* Generation indent was worked out in, 0 if never */
 } erow;
 
+/* A block of rows that has been taken out of the editor (by a 
+ * kill or a large delete) and is shared, read-only, between the
+ * kill ring, the undo log and any rows that were yanked from it.
+ * Rows are moved into a span and back by pointer; their bytes 
+ * are only copied when a row that shares them gets edited */
+typedef struct espan {
+  int refs;             /* Holders of the span, including rows sharing its chars */
+  int numrows;
+  erow *rows;           /* Rows with a NULL span own their chars */
+  size_t bytes;         /* Sum of the sizes of the rows */
+} espan;
+
+/* Data of an UNDO_INS_SPAN, UNDO_DEL_SPAN or UNDO_SWAP_SPAN record */
+typedef struct undoSpanRef {
+  espan *span;
+  int first;            /* Index of the first row of the span that is used */
+  size_t bytes;         /* Bytes of the rows that are used */
+} undoSpanRef;
+
+/* Header of a record in the undo log. The log is one block of 
+ * bytes in which every record is laid out as
+ * [undoRec][len bytes of data][size_t size of the whole record],
+ * which allows it to be walked forwards (redo) and backwards (undo) */
+typedef struct undoRec {
+  unsigned char type;
+  unsigned int group;   /* Records made by the same command share a group */
+  int row, col;
+  int n;                /* Number of rows, for UNDO_INS_ROWS/UNDO_DEL_ROWS */
+  int cx, cy;           /* Cursor position before the group's command ran */
+  size_t len;           /* Number of data bytes after the header */
+} undoRec;
+
+/* Undo/redo history */
+struct undoLog {
+  char *buf;
+  size_t len;           /* Bytes of buf in use */
+  size_t cap;           /* Bytes allocated for buf */
+  size_t pos;           /* Records before pos can be undone, those after it redone */
+  size_t spanbytes;     /* Bytes of rows kept alive by span records */
+  unsigned int group;   /* Group of the command being recorded */
+  int cx, cy;           /* Cursor position when the group started */
+  unsigned int dropped; /* Group that was too large to record, if any */
+  int suspended;        /* Nothing is recorded while > 0 */
+  int lastkind;         /* Kind of the last command, for merging typing */
+};
+
+/* An extra cursor, for typing in many places at once */
+typedef struct ecursor {
+  int cx, cy;
+} ecursor;
+
+/* Threads that batch operations over many rows are spread over */
+struct threadPool {
+  int started;
+  int numthreads;       /* Workers, not counting the main thread */
+  pthread_t threads[SPIKE_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* Signalled when a job is posted */
+  pthread_cond_t done;  /* Signalled when the last task of a job has finished */
+  void (*fn)(void *, int);
+  void *arg;
+  int ntasks;
+  int next;             /* Next task to be taken */
+  int finished;
+  unsigned int job;     /* Counts the jobs posted, so workers can tell a new one */
+};
+
+/* A node of the word index, which is a trie over the bytes of
+ * the words in the file. Nodes are kept in one array and refer to
+ * each other by index, 0 being the root */
+typedef struct wordNode {
+  int child;            /* First child, 0 if there is none */
+  int sibling;          /* Next child of the same parent, ordered by c */
+  int parent;
+  int count;            /* Times the word ending here appears */
+  int total;            /* Sum of count over this node and the nodes below it */
+  unsigned char c;
+} wordNode;
+
+typedef struct wordIndex {
+  wordNode *nodes;
+  int numnodes;
+  int cap;
+  int suspended;        /* Rows are not counted while > 0 */
+} wordIndex;
+
+/* Index of the words of a file, built by a thread of its own */
+struct wordBuild {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;          /* Whether the thread was started */
+  int done;             /* Set by the thread once it has finished */
+  char *filename;
+  wordIndex index;
+};
+
+/* Candidates of the last completion */
+struct completion {
+  int row, col;         /* Start of the word being completed */
+  int plen;             /* Length of the word as typed */
+  int n;
+  int next;             /* Candidate put in by the next Ctrl-N */
+  char *cands[SPIKE_COMPLETIONS];
+};
+
+/* A position that follows its text as rows are inserted and 
+ * deleted above it. seen counts the entries of the shift log that
+ * row already accounts for */
+typedef struct eanchor {
+  int row, col;
+  unsigned int seen;
+} eanchor;
+
+typedef struct ebookmark {
+  char *name;
+  eanchor anchor;
+} ebookmark;
+
+/* A closed fold shows its header row and hides the rows after it
+ * up to and including end */
+typedef struct efold {
+  int start, end;
+} efold;
+
+/* The closed folds of a buffer, sorted by header row. As folds
+ * come from indentation they nest, so the list is the fold tree
+ * in preorder. The outermost folds are the ones that hide rows,
+ * and top[] lists them with the number of rows hidden before 
+ * each, which maps screen lines to rows with a binary search */
+struct foldSet {
+  efold *list;
+  int num, cap;
+  int *top;             /* Indexes into list of the outermost folds */
+  int *before;          /* Rows hidden by the outermost folds before top[k] */
+  int numtop;
+  int hidden;           /* Rows hidden in all */
+  int valid;            /* Whether top, before and hidden are up to date */
+};
+
+/* An insert or delete of rows, kept for anchors to catch up on */
+struct shift {
+  int type;             /* CHANGE_INSERT, CHANGE_DELETE or CHANGE_PERMUTE */
+  int at, n;
+  int *moved;           /* Copy of L.moved for CHANGE_PERMUTE */
+};
+
+/* Inserts and deletes made since the anchors were last brought up
+ * to date all at once. Entry j of entries is shift number base + j */
+struct shiftLog {
+  struct shift *entries;
+  int len;
+  unsigned int base;
+};
+
 /* Stores the state of the editor */
 struct editorConfig {
   int cx, cy;
@@ -73,7 +339,38 @@ struct editorConfig {
   int screencols;
   int numrows;
   erow *row;                      /* Array of erow structs */
+  size_t *lineoff;                /* Byte offset of the start of each row */
+  int lineoff_valid;              /* Number of leading lineoff entries that are valid */
   int dirty;                      /* When text loaded in editor != file contents */
+  struct undoLog undo;
+  espan *killring[SPIKE_KILL_RING];  /* Most recent kill first */
+  int killlen;
+  int lastkill;                   /* Whether the last command was a kill */
+  int markset;                    /* Whether a region is being selected */
+  int markx, marky;               /* Other end of the region, the cursor being one end */
+  ecursor *cursors;               /* Extra cursors, sorted, not including E.cx/E.cy */
+  int numcursors;
+  int cursorcap;
+  ecursor lastcursor;             /* Last cursor added at a match */
+  int rectmode;                   /* Whether the region is treated as a rectangle */
+  espan *rectkill;                /* Last killed rectangle, one row per line */
+  wordIndex words;                /* Counts of the words in the rows */
+  struct wordBuild *wordbuild;    /* Index being built in the background, if any */
+  size_t renderbytes;             /* Bytes of the render and hl arrays of the rows */
+  size_t charbytes;               /* Bytes of the chars the rows own */
+  size_t sharedbytes;             /* Bytes of the chars the rows share with spans */
+  size_t slack;                   /* Bytes malloc() adds to the blocks of the rows, estimated */
+  unsigned int lastused;          /* When the buffer was last switched away from */
+  unsigned int generation;        /* Counts the changes made to the rows */
+  struct shiftLog shifts;
+  ebookmark *bookmarks;
+  int numbookmarks;
+  eanchor jumps[SPIKE_JUMPS];     /* Positions before jumps, oldest first */
+  int numjumps;
+  int jumppos;                    /* Where jumping back continues from */
+  struct foldSet folds;
+  struct completion completion;
+  int lastcomplete;               /* Whether the last command was a completion */
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
@@ -82,11 +379,153 @@ struct editorConfig {
 
 struct editorConfig E;
 
+/* Open files. The one being edited lives in E, the others wait in
+ * bufs and are swapped in and out of E with a struct copy. The 
+ * slot of the current buffer is out of date until it is left */
+struct editorBuffers {
+  struct editorConfig *bufs;
+  int numbufs;
+  int current;
+  unsigned int clock;   /* Counts switches, to tell which buffer was used last */
+};
+
+struct editorBuffers B;
+
+/* A window onto the current buffer. The views tile the screen 
+ * above the message bar, each with a status line below its rows,
+ * and each has a cursor and viewport of its own. A view only draws
+ * the lines that changed since it was last drawn */
+typedef struct eview {
+  int top, left;        /* Screen position of the first row and column, from 0 */
+  int rows, cols;       /* Size of the text area */
+  int cx, cy, rx;       /* Cursor, kept in E while the view is current */
+  int rowoff, coloff;   /* Viewport, kept in E while the view is current */
+  int drawnrow;         /* rowoff the view was last drawn at, -1 to draw it all */
+  int drawncol;         /* coloff the view was last drawn at */
+  int decorated;        /* Whether the region or extra cursors were drawn */
+  int damagefrom;       /* First row that changed since the view was drawn */
+  int damageto;         /* Last row that changed, -1 if none did */
+} eview;
+
+struct editorViews {
+  eview *views;
+  int numviews;
+  int current;
+  int termrows, termcols;
+};
+
+/* Subsystems that keep something derived from the rows, which 
+ * they are told about every change to */
+struct editorListeners {
+  void (*fn[SPIKE_MAX_LISTENERS])(int type, int at, int n);
+  int num;
+  const int *moved;     /* During CHANGE_PERMUTE, row at + k went to at + moved[k] */
+};
+
+/* Times of the stages of the last frames, kept for the profiling
+ * HUD. Only background is written to by other threads */
+struct editorProfile {
+  int show;                       /* Whether the HUD is in the status bar */
+  long long stage[STAGE_COUNT];   /* Nanoseconds of the frame being made */
+  long long frames[SPIKE_PROFILE_FRAMES][STAGE_COUNT + 1];  /* And bytes written */
+  int numframes;
+  int next;                       /* Slot of frames the next frame goes in */
+  long long keyread;              /* When the last key was read, 0 once it is timed */
+  pthread_mutex_t lock;
+  long long background;           /* Nanoseconds of background work since the last frame */
+  long long total;                /* Frames made since the editor started */
+};
+
+/* Times from reading a key to flushing the frame that shows it, in
+ * an HDR style histogram: buckets are exact below 2 * SUB ns and 
+ * then split every power of two into SUB buckets, so every time 
+ * is kept to within about 3% in a fixed amount of memory */
+struct editorLatency {
+  long long counts[SPIKE_LATENCY_BUCKETS];
+  long long total;                /* Keys timed */
+  long long sum;
+  long long max;
+  long long *pending;             /* When the keys not painted yet were read */
+  int numpending, cappending;
+};
+
+/* Keys being replayed, and what is measured while they are */
+struct editorReplay {
+  char *keys;           /* NULL unless replaying */
+  size_t len, pos;
+  FILE *record;         /* Where the keys read are recorded, if anywhere */
+  int headless;         /* Whether output is counted instead of written */
+  int rows, cols;       /* Screen size when headless */
+  long long start;      /* When the replay started */
+  size_t outbytes;      /* Bytes of output, written or not */
+};
+
+/* The beginning or the end of something being traced */
+struct traceEvent {
+  const char *name;     /* A string literal */
+  long long ts;         /* editorNow() when it happened */
+  char phase;           /* 'B' or 'E', as in a Chrome trace */
+};
+
+/* The last events of one thread. Only that thread writes to it, 
+ * so events are added without taking a lock */
+struct traceRing {
+  struct traceEvent events[SPIKE_TRACE_EVENTS];
+  volatile unsigned long count;   /* Events ever added, the last SPIKE_TRACE_EVENTS are kept */
+  volatile int released;          /* Whether its thread has ended */
+  const char *name;
+  int tid;
+  const char *open[SPIKE_TRACE_DEPTH];   /* Names of the spans begun and not ended */
+  int depth;
+};
+
+/* Tracing started with --trace, and the ring of every thread */
+struct editorTrace {
+  char *filename;       /* NULL unless tracing */
+  long long start;
+  pthread_key_t key;    /* Ring of the calling thread */
+  struct traceRing *rings[SPIKE_TRACE_THREADS];
+  volatile int numrings;
+  int lasttid;
+  pthread_mutex_t lock; /* Taken only to give a thread its ring */
+};
+
+/* Shared by every buffer */
+struct threadPool P;
+struct editorViews V;
+struct editorListeners L;
+struct editorProfile T;
+struct editorLatency H;
+struct editorReplay R;
+struct editorTrace X;
+
 /* =============== Prototypes =============== */
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorSetCursor(int row, int col);
+void editorMoveCursor(int key);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoRecord(int type, int row, int col, int n, const char *data, size_t len);
+void editorUndoRecordRows(int type, int at, int n);
+void editorRectApply(int at, int n, const char *data, size_t len, int insert);
+void editorDeleteText(int r1, int c1, int r2, int c2);
+void editorSwapSpanRows(espan *span, const int *rows, int n);
+void editorPermuteRows(int at, int n, const int *perm, int inverse);
+int editorWordsReady(struct editorConfig *buf);
+void editorWordsPoll();
+void initBuffer();
+void editorDamageRows(int from, int to);
+void editorResetViews();
+void editorScroll();
+void editorAnchorResolve(eanchor *a);
+void editorPushJump();
+long long editorNow();
+int editorReadByte(char *c, int wait);
+void editorWrite(const char *s, size_t len);
+void editorTraceBegin(const char *name);
+void editorTraceEnd(const char *name);
+void editorLatencyKey();
 
 /* =============== Terminal =============== */
 
@@ -105,6 +544,7 @@ void die(const char *s) {
 
 /* Restores terminal's original attributes */
 void disableRawMode() {
+  if (R.headless) return;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
     die("tcsetattr");
   }
@@ -129,9 +569,16 @@ void enableRawMode() {
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+
+  /* Word indexes built in the background are merged in while
+   * waiting, which read() timing out lets happen every so often */
+  editorWordsPoll();
+  while ((nread = editorReadByte(&c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    editorWordsPoll();
   }
+  T.keyread = editorNow();
+  editorLatencyKey();
 
   if (c == '\x1b') {
     char seq[3];
@@ -139,15 +586,23 @@ int editorReadKey() {
     /* Reads 2 more bytes into the seq buffer to determine if
      * it is an escape sequence or if the user just pressed the 
      * Escape key */
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0], 0) != 1) return '\x1b';
+
+    /* Alt and a key arrive as escape and the key */
+    switch (seq[0]) {
+      case 'b': return WORD_LEFT;
+      case 'f': return WORD_RIGHT;
+      case '{': return PARA_UP;
+      case '}': return PARA_DOWN;
+    }
+    if (editorReadByte(&seq[1], 0) != 1) return '\x1b';
 
     /* Determines if the escape sequence is an arrow key,   
      * Page up/down key, Del key, or Home/End key escape 
      * sequence. If it is, the corresponding key is returned */
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-	if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+	if (editorReadByte(&seq[2], 0) != 1) return '\x1b';
 	if (seq[2] == '~') {
 	  switch (seq[1]) {
 	    case '1': return HOME_KEY;
@@ -158,6 +613,20 @@ int editorReadKey() {
 	    case '7': return HOME_KEY;     /* Actual sequence is dependent on */     
 	    case '8': return END_KEY;      /* user's OS or terminal emulator */      
 	  }
+	} else if (seq[1] == '1' && seq[2] == ';') {
+
+	  /* Arrow keys with Ctrl held are sent as "\x1b[1;5A" */
+	  char mod[2];
+	  if (editorReadByte(&mod[0], 0) != 1) return '\x1b';
+	  if (editorReadByte(&mod[1], 0) != 1) return '\x1b';
+	  if (mod[0] == '5') {
+	    switch (mod[1]) {
+	      case 'A': return PARA_UP;
+	      case 'B': return PARA_DOWN;
+	      case 'C': return WORD_RIGHT;
+	      case 'D': return WORD_LEFT;
+	    }
+	  }
 	}
       } else {
 	switch (seq[1]) {
@@ -177,6 +646,12 @@ int editorReadKey() {
     }
     
     return '\x1b';
+  } else if (c == '\n') {
+
+    /* Ctrl-J sends a line feed, which is taken as Enter rather than
+     * inserted: a row holding '\n' would be saved as two lines and
+     * could not be told apart from two rows in the undo log */
+    return '\r';
   } else {
     return c;
   }
@@ -228,8 +703,738 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/* =============== Allocation Stats =============== */
+
+/* With SPIKE_ALLOC_STATS, every live block is kept in a hash table
+ * from its address to its size and tag, so that a free is counted
+ * against the part that made the block. Blocks made by the C 
+ * library, such as the buffer of getline(), are not in the table
+ * and their frees are counted as untracked. The wrappers call the
+ * real functions with the names in parentheses, which are not 
+ * expanded as macros */
+
+#ifdef SPIKE_ALLOC_STATS
+struct allocEntry {
+  void *p;              /* NULL for an empty slot */
+  size_t size;
+  int tag;
+};
+
+struct allocStats {
+  pthread_mutex_t lock;
+  struct allocEntry *table;
+  size_t cap, num;      /* cap is a power of 2 */
+  long long allocs[ALLOC_COUNT];
+  long long reallocs[ALLOC_COUNT];
+  long long frees[ALLOC_COUNT];
+  long long bytes[ALLOC_COUNT];     /* Bytes asked for in all */
+  long long live[ALLOC_COUNT];      /* Bytes in blocks not yet freed */
+  long long peak[ALLOC_COUNT];      /* Highest live has been */
+  long long untracked;              /* Frees of blocks not in the table */
+};
+
+struct allocStats A = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, {0}, {0}, {0}, {0}, {0}, {0}, 0 };
+
+size_t allocSlot(void *p) {
+  size_t h = (size_t)p;
+  h ^= h >> 17;
+  h *= (size_t)0x9E3779B97F4A7C15ULL;
+  return (h ^ (h >> 29)) & (A.cap - 1);
+}
+
+/* Takes p out of the table, returning its entry (p is NULL in the 
+ * result if it was not there). The entries after it are moved back 
+ * so that no probe sequence is broken */
+struct allocEntry allocRemove(void *p) {
+  struct allocEntry found = { NULL, 0, 0 };
+  if (A.cap == 0) return found;
+  size_t i = allocSlot(p);
+  while (A.table[i].p && A.table[i].p != p) i = (i + 1) & (A.cap - 1);
+  if (A.table[i].p == NULL) return found;
+
+  found = A.table[i];
+  A.num--;
+  size_t j = i;
+  while (1) {
+    A.table[i].p = NULL;
+    size_t k;
+    do {
+      j = (j + 1) & (A.cap - 1);
+      if (A.table[j].p == NULL) return found;
+      k = allocSlot(A.table[j].p);
+    } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+    A.table[i] = A.table[j];
+    i = j;
+  }
+}
+
+void allocInsert(void *p, size_t size, int tag) {
+  if ((A.num + 1) * 2 > A.cap) {
+    struct allocEntry *old = A.table;
+    size_t oldcap = A.cap, j;
+    A.cap = A.cap ? A.cap * 2 : 1024;
+    A.table = (calloc)(A.cap, sizeof(struct allocEntry));
+    A.num = 0;
+    for (j = 0; j < oldcap; j++) 
+      if (old[j].p) allocInsert(old[j].p, old[j].size, old[j].tag);
+    (free)(old);
+  }
+  size_t i = allocSlot(p);
+  while (A.table[i].p) i = (i + 1) & (A.cap - 1);
+  A.table[i].p = p;
+  A.table[i].size = size;
+  A.table[i].tag = tag;
+  A.num++;
+}
+
+/* Counts a block leaving the table against the part that made it */
+void allocForget(void *p) {
+  struct allocEntry e = allocRemove(p);
+  if (e.p) {
+    A.frees[e.tag]++;
+    A.live[e.tag] -= e.size;
+  } else {
+    A.untracked++;
+  }
+}
+
+void *editorTrackedRealloc(int tag, void *p, size_t size) {
+
+  /* The old block leaves the table before realloc(), as its address
+   * may be handed out again as soon as it is freed */
+  struct allocEntry e = { NULL, 0, 0 };
+  if (p) {
+    pthread_mutex_lock(&A.lock);
+    e = allocRemove(p);
+    pthread_mutex_unlock(&A.lock);
+  }
+
+  void *q = (realloc)(p, size);
+  pthread_mutex_lock(&A.lock);
+  if (q == NULL) {
+    if (e.p) allocInsert(e.p, e.size, e.tag);
+    pthread_mutex_unlock(&A.lock);
+    return NULL;
+  }
+  if (e.p) A.live[e.tag] -= e.size;
+  if (p) A.reallocs[tag]++;
+  else A.allocs[tag]++;
+  A.bytes[tag] += size;
+  A.live[tag] += size;
+  if (A.live[tag] > A.peak[tag]) A.peak[tag] = A.live[tag];
+  allocInsert(q, size, tag);
+  pthread_mutex_unlock(&A.lock);
+  return q;
+}
+
+void editorTrackedFree(void *p) {
+  if (p == NULL) return;
+  pthread_mutex_lock(&A.lock);
+  allocForget(p);
+  pthread_mutex_unlock(&A.lock);
+  (free)(p);
+}
+
+void *editorTrackedCalloc(int tag, size_t n, size_t size) {
+  void *p = editorTrackedRealloc(tag, NULL, n * size);
+  if (p) memset(p, 0, n * size);
+  return p;
+}
+
+char *editorTrackedStrdup(int tag, const char *s) {
+  size_t len = strlen(s) + 1;
+  char *d = editorTrackedRealloc(tag, NULL, len);
+  if (d) memcpy(d, s, len);
+  return d;
+}
+
+/* Writes the stats of every part into buf, one line each */
+int editorAllocReport(char *buf, size_t size) {
+  static const char *names[ALLOC_COUNT] = { "other", "render", "rows", "index", "spans",
+    "words", "edit", "undo", "file", "buffers", "find", "abuf", "screen" };
+  int len = snprintf(buf, size, "%-8s %10s %10s %10s %14s %12s %12s\n", "part",
+		     "allocs", "reallocs", "frees", "bytes", "live", "peak");
+  int j;
+  pthread_mutex_lock(&A.lock);
+  for (j = 0; j < ALLOC_COUNT && len < (int)size; j++) {
+    len += snprintf(&buf[len], size - len, "%-8s %10lld %10lld %10lld %14lld %12lld %12lld\n",
+		    names[j], A.allocs[j], A.reallocs[j], A.frees[j], A.bytes[j],
+		    A.live[j], A.peak[j]);
+  }
+  if (len < (int)size) 
+    len += snprintf(&buf[len], size - len, "untracked frees %lld\n", A.untracked);
+  pthread_mutex_unlock(&A.lock);
+  return len < (int)size ? len : (int)size - 1;
+}
+
+/* Prints the stats when the editor exits */
+void editorAllocAtExit() {
+  char buf[2048];
+  disableRawMode();
+  editorAllocReport(buf, sizeof(buf));
+  fputs(buf, stderr);
+}
+#endif
+
+/* Estimates the bytes malloc() adds to a block of n bytes, as the
+ * memory report does not have the allocator's own numbers. This
+ * is what glibc's allocator does: a size_t header, rounded up to
+ * 16 bytes, with blocks of at least 32 bytes */
+size_t editorMallocSlack(size_t n) {
+  size_t chunk = (n + sizeof(size_t) + 15) & ~(size_t)15;
+  if (chunk < 32) chunk = 32;
+  return chunk - n;
+}
+
+/* =============== Profiling =============== */
+
+/* Every frame, the time spent in each stage of making it and the 
+ * bytes it wrote are kept, for the last SPIKE_PROFILE_FRAMES frames.
+ * A frame is made by editorRefreshScreen(), and the key stage of
+ * a frame is the handling of the keys read since the frame before */
+
+/* Returns a monotonic time in nanoseconds */
+long long editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Adds time spent by a thread other than the main one */
+void editorProfileBackground(long long ns) {
+  pthread_mutex_lock(&T.lock);
+  T.background += ns;
+  pthread_mutex_unlock(&T.lock);
+}
+
+/* Ends the key stage of the frame about to be drawn. It is called
+ * as each frame starts, and not once a keypress has been handled,
+ * so that the frames a prompt draws while the key that opened it
+ * is being handled get the time spent up to each of them */
+void editorProfileKey() {
+  if (T.keyread == 0) return;
+  T.stage[STAGE_KEY] += editorNow() - T.keyread;
+  T.keyread = 0;
+}
+
+/* Ends the frame being made, which wrote bytes to the terminal */
+void editorProfileFrame(size_t bytes) {
+  pthread_mutex_lock(&T.lock);
+  T.stage[STAGE_BACKGROUND] = T.background;
+  T.background = 0;
+  pthread_mutex_unlock(&T.lock);
+
+  long long *f = T.frames[T.next];
+  memcpy(f, T.stage, sizeof(T.stage));
+  f[STAGE_COUNT] = (long long)bytes;
+  T.next = (T.next + 1) % SPIKE_PROFILE_FRAMES;
+  if (T.numframes < SPIKE_PROFILE_FRAMES) T.numframes++;
+  T.total++;
+  memset(T.stage, 0, sizeof(T.stage));
+}
+
+int editorCompareLongLong(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/* Gets the last value of a stage (or of the bytes written, for
+ * STAGE_COUNT) and its median and 99th percentile over the frames
+ * that are kept */
+void editorProfileStats(int stage, long long *last, long long *p50, long long *p99) {
+  long long sorted[SPIKE_PROFILE_FRAMES];
+  int n = T.numframes, j;
+  *last = *p50 = *p99 = 0;
+  if (n == 0) return;
+
+  for (j = 0; j < n; j++) sorted[j] = T.frames[j][stage];
+  qsort(sorted, n, sizeof(long long), editorCompareLongLong);
+  *last = T.frames[(T.next + SPIKE_PROFILE_FRAMES - 1) % SPIKE_PROFILE_FRAMES][stage];
+  *p50 = sorted[n / 2];
+  *p99 = sorted[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+}
+
+/* Writes the HUD shown in the status bar into buf. Times are in 
+ * microseconds, as last/p50/p99 */
+int editorProfileHud(char *buf, size_t size) {
+  static const char *names[STAGE_COUNT] = { "key", "scroll", "draw", "write", "bg" };
+  long long last, p50, p99;
+  int len = 0, j;
+
+  for (j = 0; j < STAGE_COUNT && len < (int)size; j++) {
+    editorProfileStats(j, &last, &p50, &p99);
+    len += snprintf(&buf[len], size - len, "%s %lld/%lld/%lld ", names[j],
+		    last / 1000, p50 / 1000, p99 / 1000);
+  }
+  if (len < (int)size) {
+    editorProfileStats(STAGE_COUNT, &last, &p50, &p99);
+    len += snprintf(&buf[len], size - len, "us | %lld/%lld/%lld B", last, p50, p99);
+  }
+  return len < (int)size ? len : (int)size - 1;
+}
+
+/* Returns the bucket of the latency histogram a time falls in */
+int editorLatencyBucket(long long ns) {
+  unsigned long long v = ns > 0 ? (unsigned long long)ns : 0;
+  int shift = 0;
+  while ((v >> shift) >= 2 * SPIKE_LATENCY_SUB) shift++;
+  int bucket = shift * SPIKE_LATENCY_SUB + (int)(v >> shift);
+  return bucket < SPIKE_LATENCY_BUCKETS ? bucket : SPIKE_LATENCY_BUCKETS - 1;
+}
+
+/* Returns the lowest time that falls in a bucket */
+long long editorLatencyValue(int bucket) {
+  if (bucket < 2 * SPIKE_LATENCY_SUB) return bucket;
+  int shift = bucket / SPIKE_LATENCY_SUB - 1;
+  return (long long)(bucket - shift * SPIKE_LATENCY_SUB) << shift;
+}
+
+/* Called by editorReadKey() with every key it reads. A paste or a
+ * held key can bring many keys before a frame, and those are the
+ * slow frames, so room is made for every one of them */
+void editorLatencyKey() {
+  if (H.numpending == H.cappending) {
+    H.cappending = H.cappending ? H.cappending * 2 : SPIKE_LATENCY_PENDING;
+    H.pending = realloc(H.pending, sizeof(long long) * H.cappending);
+  }
+  H.pending[H.numpending++] = T.keyread;
+}
+
+/* Called once a frame has been flushed to the terminal. The keys
+ * read since the frame before are the ones it shows */
+void editorLatencyPainted() {
+  if (H.numpending == 0) return;
+  long long now = editorNow();
+  int j;
+  for (j = 0; j < H.numpending; j++) {
+    long long ns = now - H.pending[j];
+    H.counts[editorLatencyBucket(ns)]++;
+    H.total++;
+    H.sum += ns;
+    if (ns > H.max) H.max = ns;
+  }
+  H.numpending = 0;
+}
+
+/* Returns the time that a fraction q of the keys were painted 
+ * within, as the highest time of its bucket */
+long long editorLatencyPercentile(double q) {
+  long long want = (long long)(q * H.total + 0.5), seen = 0;
+  int j;
+  if (want < 1) want = 1;
+  for (j = 0; j < SPIKE_LATENCY_BUCKETS && H.total > 0; j++) {
+    seen += H.counts[j];
+    if (seen >= want) {
+      long long high = editorLatencyValue(j + 1) - 1;
+      return high < H.max ? high : H.max;
+    }
+  }
+  return H.max;
+}
+
+/* Writes the percentiles of the latency histogram, and the keys
+ * painted within each power of two, into buf. Times are in 
+ * microseconds */
+int editorLatencyReport(char *buf, size_t size) {
+  static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+  int len = snprintf(buf, size, "keys %lld, mean %.1f, max %.1f\n", H.total,
+		     H.total ? H.sum / 1000.0 / H.total : 0.0, H.max / 1000.0);
+  int j;
+  for (j = 0; j < 4 && len < (int)size; j++) {
+    len += snprintf(&buf[len], size - len, "p%-6g %12.1f\n", qs[j] * 100,
+		    editorLatencyPercentile(qs[j]) / 1000.0);
+  }
+  if (len < (int)size) 
+    len += snprintf(&buf[len], size - len, "\n%14s %12s %10s\n", "up to", "keys", "cumulative");
+
+  long long seen = 0;
+  for (j = 0; j < SPIKE_LATENCY_BUCKETS && len < (int)size && seen < H.total; j += SPIKE_LATENCY_SUB) {
+    long long n = 0;
+    int k;
+    for (k = j; k < j + SPIKE_LATENCY_SUB; k++) n += H.counts[k];
+    if (n == 0) continue;
+    seen += n;
+    len += snprintf(&buf[len], size - len, "%14.1f %12lld %9.2f%%\n",
+		    (editorLatencyValue(j + SPIKE_LATENCY_SUB) - 1) / 1000.0, n,
+		    100.0 * seen / H.total);
+  }
+  return len < (int)size ? len : (int)size - 1;
+}
+
+/* =============== Replay =============== */
+
+/* Keys recorded with --record can be fed back through 
+ * editorProcessKeypress() with --replay, to get numbers that can
+ * be compared from run to run. With --headless nothing is written
+ * to the terminal and frames are only counted, on a screen of the
+ * size given by --size. The time from reading each key to painting
+ * the frame after it is kept, and summed up when the replay ends */
+
+/* Reads a byte of input the way read() does, from the terminal or
+ * from the keys being replayed. A replay that runs out of keys 
+ * while a new key is waited for ends the editor */
+int editorReadByte(char *c, int wait) {
+  if (R.keys) {
+    if (R.pos < R.len) {
+      *c = R.keys[R.pos++];
+      return 1;
+    }
+    if (!wait) return 0;
+    if (!R.headless) editorWrite("\x1b[2J\x1b[H", 7);
+    exit(0);
+  }
+
+  int nread = read(STDIN_FILENO, c, 1);
+  if (nread == 1 && R.record) fputc(*c, R.record);
+  return nread;
+}
+
+/* Writes to the terminal, or only counts the bytes when headless */
+void editorWrite(const char *s, size_t len) {
+  R.outbytes += len;
+  if (!R.headless) write(STDOUT_FILENO, s, len);
+}
+
+/* Reads the keys of a replay */
+void editorReplayLoad(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) die("fopen");
+  size_t cap = 4096;
+  R.keys = malloc(cap);
+  size_t n;
+  while ((n = fread(&R.keys[R.len], 1, cap - R.len, fp)) > 0) {
+    R.len += n;
+    if (R.len == cap) R.keys = realloc(R.keys, cap *= 2);
+  }
+  fclose(fp);
+}
+
+/* Prints what the replay measured when the editor exits. Times 
+ * are in microseconds */
+void editorReplayReport() {
+  long long total = editorNow() - R.start;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  if (!R.headless) disableRawMode();
+  printf("key_bytes %zu\n", R.pos);
+  printf("frames %lld\n", T.total);
+  printf("total_us %lld\n", total / 1000);
+  printf("latency_p50_us %lld\n", editorLatencyPercentile(0.5) / 1000);
+  printf("latency_p90_us %lld\n", editorLatencyPercentile(0.9) / 1000);
+  printf("latency_p99_us %lld\n", editorLatencyPercentile(0.99) / 1000);
+  printf("latency_max_us %lld\n", H.max / 1000);
+  printf("bytes_out %zu\n", R.outbytes);
+  printf("peak_rss_kb %ld\n", ru.ru_maxrss);
+}
+
+/* =============== Tracing =============== */
+
+/* With --trace, the beginning and end of key handling, row updates,
+ * highlighting, frames, I/O and background jobs are recorded by 
+ * every thread into a ring of its own. They are written out as a
+ * Chrome trace (chrome://tracing or ui.perfetto.dev can open it)
+ * when the editor exits, or on Ctrl-] t */
+
+/* Called when a traced thread ends, so that its ring can be given
+ * to the next thread that starts */
+void editorTraceRelease(void *ring) {
+  ((struct traceRing *)ring)->released = 1;
+}
+
+void editorTraceStart(char *filename) {
+  X.filename = filename;
+  X.start = editorNow();
+  pthread_mutex_init(&X.lock, NULL);
+  pthread_key_create(&X.key, editorTraceRelease);
+}
+
+/* Returns the ring of the calling thread, giving it one the first
+ * time. NULL if there are too many threads to trace */
+struct traceRing *editorTraceRing() {
+  struct traceRing *r = pthread_getspecific(X.key);
+  if (r) return r;
+
+  pthread_mutex_lock(&X.lock);
+  int j;
+  for (j = 0; j < X.numrings; j++) {
+    if (X.rings[j]->released) {
+
+      /* The events of the thread that ended are dropped, as they
+       * would be overwritten by the new thread's anyway */
+      r = X.rings[j];
+      r->count = 0;
+      r->depth = 0;
+      r->tid = ++X.lasttid;
+      r->released = 0;
+      break;
+    }
+  }
+  if (r == NULL && X.numrings < SPIKE_TRACE_THREADS) {
+    r = calloc(1, sizeof(struct traceRing));
+    r->tid = ++X.lasttid;
+    X.rings[X.numrings] = r;
+    __sync_synchronize();      /* The ring is there before it is counted */
+    X.numrings++;
+  }
+  pthread_mutex_unlock(&X.lock);
+  if (r) {
+    r->name = "thread";
+    pthread_setspecific(X.key, r);
+  }
+  return r;
+}
+
+/* Names the calling thread in the trace */
+void editorTraceName(const char *name) {
+  if (!X.filename) return;
+  struct traceRing *r = editorTraceRing();
+  if (r) r->name = name;
+}
+
+void editorTraceEvent(const char *name, char phase) {
+  struct traceRing *r = editorTraceRing();
+  if (r == NULL) return;
+  struct traceEvent *ev = &r->events[r->count & (SPIKE_TRACE_EVENTS - 1)];
+  ev->name = name;
+  ev->ts = editorNow();
+  ev->phase = phase;
+  __sync_synchronize();        /* The event is written before it is counted */
+  r->count++;
+
+  if (phase == 'B') {
+    if (r->depth < SPIKE_TRACE_DEPTH) r->open[r->depth] = name;
+    r->depth++;
+  } else if (r->depth > 0) {
+    r->depth--;
+  }
+}
+
+void editorTraceBegin(const char *name) {
+  if (X.filename) editorTraceEvent(name, 'B');
+}
+
+void editorTraceEnd(const char *name) {
+  if (X.filename) editorTraceEvent(name, 'E');
+}
+
+/* Writes the events kept so far to the trace file. Returns the 
+ * number of events written, or -1 if the file can't be written */
+long editorTraceDump() {
+  FILE *fp = fopen(X.filename, "w");
+  if (!fp) return -1;
+
+  int pid = (int)getpid();
+  int numrings = X.numrings, j;
+  long written = 0;
+  __sync_synchronize();
+  fputs("{\"traceEvents\":[\n", fp);
+  for (j = 0; j < numrings; j++) {
+    struct traceRing *r = X.rings[j];
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+	    "\"args\":{\"name\":\"%s\"}}", j ? ",\n" : "", pid, r->tid, r->name);
+
+    /* Events are read up to the count seen here, older ones may be
+     * overwritten while they are read if the thread is busy */
+    unsigned long count = r->count, k;
+    __sync_synchronize();
+    for (k = count > SPIKE_TRACE_EVENTS ? count - SPIKE_TRACE_EVENTS : 0; k < count; k++) {
+      struct traceEvent *ev = &r->events[k & (SPIKE_TRACE_EVENTS - 1)];
+      fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+	      ev->name, ev->phase, (ev->ts - X.start) / 1000.0, pid, r->tid);
+      written++;
+    }
+  }
+  fputs("\n]}\n", fp);
+  if (fclose(fp) != 0) return -1;
+  return written;
+}
+
+/* Writes the trace when the editor exits. exit() can be called
+ * from inside a span, such as the key that quits, so the spans
+ * the exiting thread has open are ended first */
+void editorTraceAtExit() {
+  struct traceRing *r = pthread_getspecific(X.key);
+  while (r && r->depth > 0) {
+    int top = r->depth - 1;
+    editorTraceEnd(top < SPIKE_TRACE_DEPTH ? r->open[top] : "span");
+  }
+  if (editorTraceDump() == -1) perror(X.filename);
+}
+
+/* =============== Thread Pool =============== */
+
+/* Worker threads wait here for a job to be posted and then take
+ * its tasks, one at a time, until none are left */
+void *poolWorker(void *unused) {
+  (void)unused;
+  struct threadPool *pool = &P;
+  unsigned int seen = 0;
+  editorTraceName("pool worker");
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->job == seen) pthread_cond_wait(&pool->work, &pool->lock);
+    seen = pool->job;
+
+    while (pool->next < pool->ntasks) {
+      int task = pool->next++;
+      pthread_mutex_unlock(&pool->lock);
+      long long start = editorNow();
+      editorTraceBegin("pool task");
+      pool->fn(pool->arg, task);
+      editorTraceEnd("pool task");
+      editorProfileBackground(editorNow() - start);
+      pthread_mutex_lock(&pool->lock);
+      if (++pool->finished == pool->ntasks) pthread_cond_signal(&pool->done);
+    }
+  }
+  return NULL;
+}
+
+/* Starts the workers, one fewer than there are processors since 
+ * the main thread takes tasks too. Only done once a job actually
+ * needs them */
+void poolInit() {
+  struct threadPool *pool = &P;
+  pool->started = 1;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > SPIKE_MAX_THREADS) cpus = SPIKE_MAX_THREADS;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  while (pool->numthreads < cpus - 1) {
+    if (pthread_create(&pool->threads[pool->numthreads], NULL, poolWorker, NULL) != 0)
+      break;
+    pool->numthreads++;
+  }
+}
+
+/* Returns the number of threads a job is spread over, including
+ * the main thread */
+int poolThreads() {
+  if (!P.started) poolInit();
+  return P.numthreads + 1;
+}
+
+/* Runs fn(arg, task) for every task from 0 to ntasks - 1, spread
+ * over the workers and the main thread, and returns once they 
+ * have all finished. Tasks must not touch anything another task
+ * of the same job is writing to */
+void poolRun(void (*fn)(void *, int), void *arg, int ntasks) {
+  struct threadPool *pool = &P;
+  if (ntasks <= 1 || poolThreads() == 1) {
+    int j;
+    for (j = 0; j < ntasks; j++) fn(arg, j);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->ntasks = ntasks;
+  pool->next = 0;
+  pool->finished = 0;
+  pool->job++;
+  pthread_cond_broadcast(&pool->work);
+
+  while (pool->next < pool->ntasks) {
+    int task = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    editorTraceBegin("pool task");
+    fn(arg, task);
+    editorTraceEnd("pool task");
+    pthread_mutex_lock(&pool->lock);
+    pool->finished++;
+  }
+  while (pool->finished < pool->ntasks) pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* =============== Character Classes =============== */
+
+/* Every byte is blank, part of a word or punctuation. Word motions,
+ * indents and the word index all look bytes up in the same table,
+ * and the scans below find where a run of bytes of some classes 
+ * ends. With SSE2 the bytes are classified 32 at a time with the
+ * same rules as the table, so long runs cost one step per 32 bytes */
+
+unsigned char charClass[256];
+
+void editorInitCharClass() {
+  int c;
+  for (c = 0; c < 256; c++) {
+    if (c == ' ' || c == '\t') charClass[c] = CLASS_BLANK;
+    else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+	     (c >= '0' && c <= '9') || c == '_' || c >= 0x80) charClass[c] = CLASS_WORD;
+    else charClass[c] = CLASS_PUNCT;
+  }
+}
+
+#ifdef SPIKE_SIMD
+/* Returns a bit for each of 16 bytes, set if its class is in mask */
+unsigned int editorClassBits(const char *s, int mask) {
+  __m128i v = _mm_loadu_si128((const __m128i *)s);
+  __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			       _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+
+  /* A byte is in a range when it is below the end of the range 
+   * once moved so that the range starts at -128 */
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8((char)(0x80 - 'a'))),
+				  _mm_set1_epi8((char)(0x80 + 26)));
+  __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - '0'))),
+				 _mm_set1_epi8((char)(0x80 + 10)));
+  __m128i word = _mm_or_si128(_mm_or_si128(letter, digit),
+			      _mm_or_si128(_mm_cmplt_epi8(v, _mm_setzero_si128()),
+					   _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+
+  __m128i in = _mm_setzero_si128();
+  if (mask & CLASS_BLANK) in = _mm_or_si128(in, blank);
+  if (mask & CLASS_WORD) in = _mm_or_si128(in, word);
+  if (mask & CLASS_PUNCT) in = _mm_or_si128(in, _mm_andnot_si128(_mm_or_si128(blank, word),
+								 _mm_set1_epi8(-1)));
+  return (unsigned int)_mm_movemask_epi8(in);
+}
+#endif
+
+/* Returns the index of the first byte from s[from] on whose class
+ * is not in mask, or len if they all are */
+int editorSkipClass(const char *s, int from, int len, int mask) {
+#ifdef SPIKE_SIMD
+  while (from + 32 <= len) {
+    unsigned int out = ~(editorClassBits(&s[from], mask) |
+			 editorClassBits(&s[from + 16], mask) << 16);
+    if (out) return from + __builtin_ctz(out);
+    from += 32;
+  }
+#endif
+  while (from < len && (charClass[(unsigned char)s[from]] & mask)) from++;
+  return from;
+}
+
+/* Goes back from s[from] over the bytes whose class is in mask, and
+ * returns the index of the first of them (from if there are none) */
+int editorSkipClassBack(const char *s, int from, int mask) {
+#ifdef SPIKE_SIMD
+  while (from >= 32) {
+    unsigned int out = ~(editorClassBits(&s[from - 32], mask) |
+			 editorClassBits(&s[from - 16], mask) << 16);
+    if (out) return from - 32 + (32 - __builtin_clz(out));
+    from -= 32;
+  }
+#endif
+  while (from > 0 && (charClass[(unsigned char)s[from - 1]] & mask)) from--;
+  return from;
+}
+
 /* =============== Syntax Highlighting =============== */
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_RENDER
+
 /* Takes in a character and returns true if the character
  * is considered a separator character */
 int is_separator(int c) {
@@ -243,6 +1448,7 @@ int is_separator(int c) {
 /* Iterates through the characters of an erow and sets their
  * type in the hl (highlight) array */
 void editorUpdateSyntax(erow *row) {
+  editorTraceBegin("highlight");
 
   /* Reallocates a block of memory the size of the row's
    * render array */
@@ -263,6 +1469,7 @@ void editorUpdateSyntax(erow *row) {
     
     i++;
   }
+  editorTraceEnd("highlight");
 }
 
 /* Maps the values in the hl array to the ANSI color 
@@ -275,60 +1482,494 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
-/* =============== Row Operations =============== */
+/* =============== Change Events =============== */
 
-/* Converts a chars index into a render index */
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
+/* Adds a function to be called on every change to the rows */
+void editorListen(void (*fn)(int type, int at, int n)) {
+  if (L.num < SPIKE_MAX_LISTENERS) L.fn[L.num++] = fn;
+}
 
-  /* Accounts for tabs and their whitespace */
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (SPIKE_TAB_STOP - 1) - (rx % SPIKE_TAB_STOP);
-    rx++;
+/* Tells every listener that n rows from at on were inserted, 
+ * deleted, modified or reordered. Inserted and modified rows are
+ * stamped with a new generation, so that anything derived from a
+ * row can tell whether it is out of date by comparing generations.
+ * Reordered rows keep theirs, as their contents did not change */
+void editorNotify(int type, int at, int n) {
+  E.generation++;
+  if (type == CHANGE_INSERT || type == CHANGE_MODIFY) {
+    int j;
+    for (j = at; j < at + n && j < E.numrows; j++) E.row[j].gen = E.generation;
   }
-  return rx;
+  int j;
+  for (j = 0; j < L.num; j++) L.fn[j](type, at, n);
 }
 
-/* Converts a render index into a chars index */
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
+/* =============== Line Index =============== */
 
-  /* Loops through the chars string until cur_rx reaches
-   * the given rx value and returns cx */
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (SPIKE_TAB_STOP - 1) - (cur_rx % SPIKE_TAB_STOP);
-    cur_rx++;
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_INDEX
 
-    if (cur_rx > rx) return cx;
+/* Marks the line index as stale from row at onwards. Entries 
+ * before at still hold their correct byte offsets, so only the
+ * part after an edit has to be recomputed */
+void editorInvalidateLineIndex(int at) {
+  if (at < E.lineoff_valid) E.lineoff_valid = at < 0 ? 0 : at;
+}
+
+/* Keeps the line index in step with the rows. A modified row can
+ * only have moved the rows after it, inserts and deletes move the
+ * rows from where they happened on */
+void editorLineIndexChanged(int type, int at, int n) {
+  (void)n;
+  editorInvalidateLineIndex(type == CHANGE_MODIFY ? at + 1 : at);
+}
+
+/* Makes sure that the byte offsets of rows 0..upto (inclusive)
+ * are valid, extending the index from the last valid entry */
+void editorUpdateLineIndex(int upto) {
+  if (upto > E.numrows) upto = E.numrows;
+  if (upto < E.lineoff_valid) return;
+
+  /* One extra entry is kept for the offset of the end of the file */
+  E.lineoff = realloc(E.lineoff, sizeof(size_t) * (E.numrows + 1));
+
+  int j = E.lineoff_valid;
+  if (j == 0) {
+    E.lineoff[0] = 0;
+    j = 1;
   }
+  for (; j <= upto; j++)
+    E.lineoff[j] = E.lineoff[j - 1] + E.row[j - 1].size + 1;
+  E.lineoff_valid = upto + 1;
+}
 
-  /* Just in case the rx value given is out of range */
-  return cx;
+/* Returns the byte offset in the file at which a row starts */
+size_t editorRowToByte(int at) {
+  editorUpdateLineIndex(at);
+  return E.lineoff[at];
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') tabs++;
+/* Returns the row that contains the given byte offset, using a
+ * binary search over the line index */
+int editorByteToRow(size_t offset) {
+  if (E.numrows == 0) return 0;
+  editorUpdateLineIndex(E.numrows);
+
+  int lo = 0, hi = E.numrows - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (E.lineoff[mid] <= offset) lo = mid;
+    else hi = mid - 1;
   }
-  
-  free(row->render);
+  return lo;
+}
 
-  /* The maximum number of characters needed for each tab 
-   * is 8. tabs is multiplied by 7 because row->size already
-   * counts 1 for each tab */
-  row->render = malloc(row->size + tabs*(SPIKE_TAB_STOP - 1) + 1);
+/* =============== Spans =============== */
 
-  int index = 0;
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_SPANS
 
-  /* Copies each character from chars to render. Tabs are 
-   * rendered as multiple space characters */
-  for (j = 0; j < row->size; j++) {
+/* Allocates a span for numrows rows, holding one reference that
+ * belongs to the caller */
+espan *spanNew(int numrows) {
+  espan *span = malloc(sizeof(espan));
+  span->refs = 1;
+  span->numrows = numrows;
+  span->rows = calloc(numrows ? numrows : 1, sizeof(erow));
+  span->bytes = 0;
+  return span;
+}
+
+/* Drops a reference to a span. The last one frees the rows, and
+ * through them any other spans whose chars they were sharing */
+void spanRelease(espan *span) {
+  if (span == NULL || --span->refs > 0) return;
+  int j;
+  for (j = 0; j < span->numrows; j++) {
+    erow *row = &span->rows[j];
+    if (row->span) spanRelease(row->span);
+    else free(row->chars);
+  }
+  free(span->rows);
+  free(span);
+}
+
+/* Makes dst share the chars of src, which is a row of span. The
+ * reference is taken on whichever span actually owns the chars.
+ * The render and hl arrays of dst are left to be built lazily */
+void spanShareRow(espan *span, erow *src, erow *dst) {
+  dst->size = src->size;
+  dst->chars = src->chars;
+  dst->span = src->span ? src->span : span;
+  dst->span->refs++;
+  dst->rsize = 0;
+  dst->render = NULL;
+  dst->hl = NULL;
+  dst->indentgen = 0;
+}
+
+/* Builds a one row span holding a copy of len bytes of s */
+espan *spanFromString(const char *s, size_t len) {
+  espan *span = spanNew(1);
+  span->rows[0].size = len;
+  span->rows[0].chars = malloc(len + 1);
+  memcpy(span->rows[0].chars, s, len);
+  span->rows[0].chars[len] = '\0';
+  span->bytes = len;
+  return span;
+}
+
+/* Builds a span holding a followed by b, where the last row of a 
+ * and the first row of b become one row. Only those two rows are
+ * copied, every other row is shared with a or b */
+espan *spanConcat(espan *a, espan *b) {
+  espan *span = spanNew(a->numrows + b->numrows - 1);
+  int j, k = 0;
+  for (j = 0; j < a->numrows - 1; j++)
+    spanShareRow(a, &a->rows[j], &span->rows[k++]);
+
+  erow *last = &a->rows[a->numrows - 1];
+  erow *first = &b->rows[0];
+  erow *join = &span->rows[k++];
+  join->size = last->size + first->size;
+  join->chars = malloc(join->size + 1);
+  memcpy(join->chars, last->chars, last->size);
+  memcpy(&join->chars[last->size], first->chars, first->size);
+  join->chars[join->size] = '\0';
+
+  for (j = 1; j < b->numrows; j++)
+    spanShareRow(b, &b->rows[j], &span->rows[k++]);
+  span->bytes = a->bytes + b->bytes;
+  return span;
+}
+
+/* =============== Word Index =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_WORDS
+
+/* Whether c can be part of a word. Bytes of UTF-8 sequences are,
+ * so that words in other languages can be completed too */
+int isWordChar(int c) {
+  return charClass[(unsigned char)c] == CLASS_WORD;
+}
+
+/* Adds a node for the byte c under parent, returning its index */
+int wordNodeNew(wordIndex *wi, int parent, unsigned char c) {
+  if (wi->numnodes == wi->cap) {
+    wi->cap = wi->cap ? wi->cap * 2 : 1024;
+    wi->nodes = realloc(wi->nodes, sizeof(wordNode) * wi->cap);
+  }
+  wordNode *node = &wi->nodes[wi->numnodes];
+  node->child = 0;
+  node->sibling = 0;
+  node->parent = parent;
+  node->count = 0;
+  node->total = 0;
+  node->c = c;
+  return wi->numnodes++;
+}
+
+/* Adds delta to the count of a word. The totals of every node on
+ * the way are kept up to date, so that they always bound the 
+ * counts of the words below them */
+void wordIndexAdd(wordIndex *wi, const unsigned char *w, int len, int delta) {
+  if (wi->numnodes == 0) wordNodeNew(wi, -1, 0);
+
+  int node = 0;
+  wi->nodes[0].total += delta;
+  int j;
+  for (j = 0; j < len; j++) {
+
+    /* Children are kept sorted by their byte */
+    int *link = &wi->nodes[node].child;
+    while (*link && wi->nodes[*link].c < w[j]) link = &wi->nodes[*link].sibling;
+    if (*link == 0 || wi->nodes[*link].c != w[j]) {
+      int child = wordNodeNew(wi, node, w[j]);
+
+      /* The node array may have moved */
+      link = &wi->nodes[node].child;
+      while (*link && wi->nodes[*link].c < w[j]) link = &wi->nodes[*link].sibling;
+      wi->nodes[child].sibling = *link;
+      *link = child;
+    }
+    node = *link;
+    wi->nodes[node].total += delta;
+  }
+  wi->nodes[node].count += delta;
+}
+
+/* Adds delta to the count of every word in a piece of text */
+void wordIndexText(wordIndex *wi, const char *s, int len, int delta) {
+  const unsigned char *p = (const unsigned char *)s;
+  int j = 0;
+  while (j < len) {
+    while (j < len && !isWordChar(p[j])) j++;
+    int start = j;
+    while (j < len && isWordChar(p[j])) j++;
+    if (j - start >= 2 && j - start <= SPIKE_WORD_MAX)
+      wordIndexAdd(wi, &p[start], j - start, delta);
+  }
+}
+
+void wordIndexFree(wordIndex *wi) {
+  free(wi->nodes);
+  wi->nodes = NULL;
+  wi->numnodes = 0;
+  wi->cap = 0;
+}
+
+/* Adds every word below node of src, whose bytes so far are in 
+ * buf, to dst */
+void wordIndexMerge(wordIndex *dst, wordIndex *src, int node, unsigned char *buf, int len) {
+  if (src->nodes[node].count != 0)
+    wordIndexAdd(dst, buf, len, src->nodes[node].count);
+  int child;
+  for (child = src->nodes[node].child; child; child = src->nodes[child].sibling) {
+    buf[len] = src->nodes[child].c;
+    wordIndexMerge(dst, src, child, buf, len + 1);
+  }
+}
+
+/* Accounts for the render array of a row, with delta = -1 before
+ * it is rebuilt or freed and delta = 1 once it has been built. The
+ * bytes the arrays take up are kept track of for dropping them 
+ * when memory is short */
+void editorRowCache(erow *row, int delta) {
+  if (row->render == NULL) return;
+  if (row < E.row || row >= E.row + E.numrows) return;
+  E.renderbytes += (ssize_t)delta * 2 * (row->rsize + 1);
+  E.slack += (ssize_t)delta * (ssize_t)(editorMallocSlack(row->rsize + 1) +
+					 editorMallocSlack(row->rsize));
+}
+
+/* Builds an index of the words of a file, away from the main 
+ * thread. It reads the file again instead of looking at the rows,
+ * which the main thread is free to change in the meantime */
+void *wordBuildThread(void *arg) {
+  struct wordBuild *wb = arg;
+  long long start = editorNow();
+  editorTraceName("word index");
+  editorTraceBegin("word index");
+  FILE *fp = fopen(wb->filename, "r");
+  if (fp) {
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+      wordIndexText(&wb->index, line, linelen, 1);
+    free(line);
+    fclose(fp);
+  }
+
+  editorTraceEnd("word index");
+  editorProfileBackground(editorNow() - start);
+  pthread_mutex_lock(&wb->lock);
+  wb->done = 1;
+  pthread_mutex_unlock(&wb->lock);
+  return NULL;
+}
+
+/* Starts indexing the words of a file that was just opened. The 
+ * rows loaded from it are not counted one by one, the index 
+ * built in the background is merged in once it is done */
+void editorWordsStart(char *filename) {
+
+  /* The thread gets a block of its own, which stays put when the 
+   * buffer is swapped out of E */
+  struct wordBuild *wb = calloc(1, sizeof(struct wordBuild));
+  wb->filename = strdup(filename);
+  pthread_mutex_init(&wb->lock, NULL);
+  E.wordbuild = wb;
+  if (pthread_create(&wb->thread, NULL, wordBuildThread, wb) == 0) {
+    wb->running = 1;
+  } else {
+
+    /* Without a thread, the file gets indexed right away */
+    wordBuildThread(wb);
+    editorWordsReady(&E);
+  }
+}
+
+/* Merges the background index of a buffer into its live one, if 
+ * it is done. Returns 0 while it is still being built */
+int editorWordsReady(struct editorConfig *buf) {
+  struct wordBuild *wb = buf->wordbuild;
+  if (wb == NULL) return 1;
+
+  pthread_mutex_lock(&wb->lock);
+  int done = wb->done;
+  pthread_mutex_unlock(&wb->lock);
+  if (!done) return 0;
+
+  if (wb->running) pthread_join(wb->thread, NULL);
+  unsigned char word[SPIKE_WORD_MAX + 1];
+  if (wb->index.numnodes > 0) wordIndexMerge(&buf->words, &wb->index, 0, word, 0);
+  wordIndexFree(&wb->index);
+  pthread_mutex_destroy(&wb->lock);
+  free(wb->filename);
+  free(wb);
+  buf->wordbuild = NULL;
+  return 1;
+}
+
+/* Merges the background indexes whose threads have finished, of
+ * every buffer. Called while the editor waits for a key, so that
+ * the merging is done before a completion needs it */
+void editorWordsPoll() {
+  editorWordsReady(&E);
+  int j;
+  for (j = 0; j < B.numbufs; j++) {
+    if (j != B.current) editorWordsReady(&B.bufs[j]);
+  }
+}
+
+/* An entry of the heap used by wordIndexTop() */
+typedef struct wordCand {
+  int node;
+  int key;              /* Count of the word, or bound of the subtree */
+  int word;             /* Whether this is the word ending at node */
+} wordCand;
+
+/* Adds an entry to a max heap */
+void wordHeapPush(wordCand **heap, int *len, int *cap, wordCand cand) {
+  if (*len == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *heap = realloc(*heap, sizeof(wordCand) * *cap);
+  }
+  int j = (*len)++;
+  while (j > 0 && (*heap)[(j - 1) / 2].key < cand.key) {
+    (*heap)[j] = (*heap)[(j - 1) / 2];
+    j = (j - 1) / 2;
+  }
+  (*heap)[j] = cand;
+}
+
+/* Takes the largest entry off a max heap */
+wordCand wordHeapPop(wordCand *heap, int *len) {
+  wordCand top = heap[0];
+  wordCand last = heap[--(*len)];
+  int j = 0;
+  while (2 * j + 1 < *len) {
+    int child = 2 * j + 1;
+    if (child + 1 < *len && heap[child + 1].key > heap[child].key) child++;
+    if (heap[child].key <= last.key) break;
+    heap[j] = heap[child];
+    j = child;
+  }
+  if (*len > 0) heap[j] = last;
+  return top;
+}
+
+/* Finds the (at most) max most frequent words that start with 
+ * prefix, longer than it, most frequent first. Subtrees are 
+ * visited best first, by the total of their counts, which no
+ * word below them can beat, so only the part of the trie that
+ * can hold an answer is looked at. Returns the number found */
+int wordIndexTop(wordIndex *wi, const char *prefix, int plen, char **out, int max) {
+  if (wi->numnodes == 0) return 0;
+
+  int node = 0;
+  int j;
+  for (j = 0; j < plen && node != -1; j++) {
+    int child = wi->nodes[node].child;
+    while (child && wi->nodes[child].c != (unsigned char)prefix[j])
+      child = wi->nodes[child].sibling;
+    node = child ? child : -1;
+  }
+  if (node == -1) return 0;
+
+  wordCand *heap = NULL;
+  int len = 0, cap = 0, found = 0;
+  wordHeapPush(&heap, &len, &cap, (wordCand){ node, wi->nodes[node].total, 0 });
+  while (len > 0 && found < max) {
+    wordCand cand = wordHeapPop(heap, &len);
+    wordNode *n = &wi->nodes[cand.node];
+
+    if (cand.word) {
+
+      /* Spells the word out by walking back up to the root */
+      int wlen = 0, k;
+      for (k = cand.node; k > 0; k = wi->nodes[k].parent) wlen++;
+      char *w = malloc(wlen + 1);
+      w[wlen] = '\0';
+      for (k = cand.node; k > 0; k = wi->nodes[k].parent) w[--wlen] = wi->nodes[k].c;
+      out[found++] = w;
+      continue;
+    }
+
+    if (n->count > 0 && cand.node != node)
+      wordHeapPush(&heap, &len, &cap, (wordCand){ cand.node, n->count, 1 });
+    int child;
+    for (child = n->child; child; child = wi->nodes[child].sibling) {
+      if (wi->nodes[child].total > 0)
+	wordHeapPush(&heap, &len, &cap, (wordCand){ child, wi->nodes[child].total, 0 });
+    }
+  }
+  free(heap);
+  return found;
+}
+
+/* =============== Row Operations =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_RENDER
+
+/* Converts a chars index into a render index */
+int editorRowCxToRx(erow *row, int cx) {
+  int rx = 0;
+  int j;
+
+  /* Accounts for tabs and their whitespace */
+  for (j = 0; j < cx; j++) {
+    if (row->chars[j] == '\t')
+      rx += (SPIKE_TAB_STOP - 1) - (rx % SPIKE_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+/* Converts a render index into a chars index */
+int editorRowRxToCx(erow *row, int rx) {
+  int cur_rx = 0;
+  int cx;
+
+  /* Loops through the chars string until cur_rx reaches
+   * the given rx value and returns cx */
+  for (cx = 0; cx < row->size; cx++) {
+    if (row->chars[cx] == '\t')
+      cur_rx += (SPIKE_TAB_STOP - 1) - (cur_rx % SPIKE_TAB_STOP);
+    cur_rx++;
+
+    if (cur_rx > rx) return cx;
+  }
+
+  /* Just in case the rx value given is out of range */
+  return cx;
+}
+
+/* Builds the render and hl arrays of a row from its chars */
+void editorRenderRow(erow *row) {
+  int tabs = 0;
+  int j;
+  editorTraceBegin("row update");
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') tabs++;
+  }
+  
+  editorRowCache(row, -1);
+  free(row->render);
+
+  /* The maximum number of characters needed for each tab 
+   * is 8. tabs is multiplied by 7 because row->size already
+   * counts 1 for each tab */
+  row->render = malloc(row->size + tabs*(SPIKE_TAB_STOP - 1) + 1);
+
+  int index = 0;
+
+  /* Copies each character from chars to render. Tabs are 
+   * rendered as multiple space characters */
+  for (j = 0; j < row->size; j++) {
     if (row->chars[j] == '\t') {
       row->render[index++] = ' ';
       while (index % SPIKE_TAB_STOP != 0) row->render[index++] = ' ';
@@ -338,21 +1979,69 @@ void editorUpdateRow(erow *row) {
   }
   row->render[index] = '\0';
   row->rsize = index;
+  editorRowCache(row, 1);
 
   /* Called after updating the render array */
   editorUpdateSyntax(row);
+  editorTraceEnd("row update");
 }
 
-/* Inserts a row at the given index */
-void editorInsertRow(int at, char *s, size_t len) {
-  if(at < 0 || at > E.numrows) return;
+/* Builds the render array of a row that does not have one yet.
+ * Rows that were inserted from a span are only rendered once 
+ * something needs to look at them */
+void editorRowRender(erow *row) {
+  if (row->render == NULL) editorRenderRow(row);
+}
+
+/* Called whenever the chars of a row have changed */
+void editorUpdateRow(erow *row) {
+  editorRenderRow(row);
+
+  if (row >= E.row && row < E.row + E.numrows)
+    editorNotify(CHANGE_MODIFY, row - E.row, 1);
+}
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_ROWS
+
+/* Accounts for the chars of a row, with delta = -1 before they
+ * change or the row leaves the buffer and delta = 1 once they have
+ * changed or the row has come in. Rows sharing their chars with a
+ * span are counted apart from the rows that own theirs. The words
+ * of the chars are counted in the word index the same way, so it
+ * holds every row whether or not it has been rendered */
+void editorRowBytes(erow *row, int delta) {
+  if (row < E.row || row >= E.row + E.numrows) return;
+  if (!E.words.suspended) wordIndexText(&E.words, row->chars, row->size, delta);
+  ssize_t bytes = (ssize_t)delta * (row->size + 1);
+  if (row->span) {
+    E.sharedbytes += bytes;
+  } else {
+    E.charbytes += bytes;
+    E.slack += (ssize_t)delta * (ssize_t)editorMallocSlack(row->size + 1);
+  }
+}
+
+/* Opens a gap of n uninitialized erows at the given index with a
+ * single realloc() and a single memmove(), so that inserting many 
+ * rows at once does not shift the rows after them n times. The
+ * caller fills the rows in and then sends the CHANGE_INSERT */
+void editorOpenRows(int at, int n) {
 
   /* Reallocates a bigger block of memory according to the number  
    * of bytes each erow takes * the number of rows we want */
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
 
   /*            To      /   From    /              numBytes         */
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+  E.numrows += n;
+}
+
+/* Inserts a row at the given index */
+void editorInsertRow(int at, char *s, size_t len) {
+  if(at < 0 || at > E.numrows) return;
+
+  editorOpenRows(at, 1);
 
   E.row[at].size = len;
 
@@ -367,22 +2056,209 @@ void editorInsertRow(int at, char *s, size_t len) {
   E.row[at].rsize = 0;
   E.row[at].render = NULL;
   E.row[at].hl = NULL;
-  editorUpdateRow(&E.row[at]);
+  E.row[at].span = NULL;
+  E.row[at].indentgen = 0;
+  editorRowBytes(&E.row[at], 1);
+  editorRenderRow(&E.row[at]);
+  editorNotify(CHANGE_INSERT, at, 1);
   
-  E.numrows++;
+  editorUndoRecord(UNDO_INS_ROWS, at, 0, 1, s, len);
+  E.dirty++;
+}
+
+/* Inserts n blank rows at the given index, opening the gap
+ * for all of them at once */
+void editorInsertBlankRows(int at, int n) {
+  if (at < 0 || at > E.numrows || n <= 0) return;
+
+  editorOpenRows(at, n);
+
+  int j;
+  for (j = at; j < at + n; j++) {
+    E.row[j].size = 0;
+    E.row[j].chars = malloc(1);
+    E.row[j].chars[0] = '\0';
+    E.row[j].rsize = 0;
+    E.row[j].render = NULL;
+    E.row[j].hl = NULL;
+    E.row[j].span = NULL;
+    E.row[j].indentgen = 0;
+    editorRowBytes(&E.row[j], 1);
+    editorRenderRow(&E.row[j]);
+  }
+  editorNotify(CHANGE_INSERT, at, n);
+  editorUndoRecordRows(UNDO_INS_ROWS, at, n);
+  E.dirty++;
+}
+
+/* Inserts n rows at the given index from text holding the rows
+ * separated by '\n'. The gap for the rows is opened only once */
+void editorInsertRowsFromText(int at, int n, const char *s, size_t len) {
+  if (at < 0 || at > E.numrows || n <= 0) return;
+
+  editorOpenRows(at, n);
+
+  const char *p = s;
+  const char *end = s + len;
+  int j;
+  for (j = at; j < at + n; j++) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t linelen = nl ? (size_t)(nl - p) : (size_t)(end - p);
+
+    E.row[j].size = linelen;
+    E.row[j].chars = malloc(linelen + 1);
+    memcpy(E.row[j].chars, p, linelen);
+    E.row[j].chars[linelen] = '\0';
+    E.row[j].rsize = 0;
+    E.row[j].render = NULL;
+    E.row[j].hl = NULL;
+    E.row[j].span = NULL;
+    E.row[j].indentgen = 0;
+    editorRowBytes(&E.row[j], 1);
+    editorRenderRow(&E.row[j]);
+
+    p = nl ? nl + 1 : end;
+  }
+  editorNotify(CHANGE_INSERT, at, n);
+  editorUndoRecord(UNDO_INS_ROWS, at, 0, n, s, len);
   E.dirty++;
 }
 
-/* Frees the memory owned by the erow being deleted */
+/* Frees the memory owned by the erow being deleted. Shared
+ * chars are left to the span that owns them */
 void editorFreeRow(erow *row) {
+  editorRowCache(row, -1);
+  editorRowBytes(row, -1);
   free(row->render);
-  free(row->chars);
+  if (row->span) spanRelease(row->span);
+  else free(row->chars);
   free(row->hl);
 }
 
+/* Gives a row its own copy of its chars if it is sharing them
+ * with a span. Has to be called before the chars are modified */
+void editorRowWritable(erow *row) {
+  if (row->span == NULL) return;
+
+  /* The words stay the same, only the bytes move */
+  E.words.suspended++;
+  editorRowBytes(row, -1);
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  spanRelease(row->span);
+  row->span = NULL;
+  row->chars = chars;
+  editorRowBytes(row, 1);
+  E.words.suspended--;
+}
+
+/* Inserts n rows of a span, starting at its row first, at the
+ * given index. The rows share the span's chars, so no bytes 
+ * are copied, and they are rendered when they are first drawn */
+void editorInsertSpanRows(int at, espan *span, int first, int n) {
+  if (at < 0 || at > E.numrows || n <= 0) return;
+
+  editorOpenRows(at, n);
+
+  size_t bytes = 0;
+  int j;
+  for (j = 0; j < n; j++) {
+    spanShareRow(span, &span->rows[first + j], &E.row[at + j]);
+    editorRowBytes(&E.row[at + j], 1);
+    bytes += E.row[at + j].size;
+  }
+  editorNotify(CHANGE_INSERT, at, n);
+
+  undoSpanRef ref = { span, first, bytes };
+  editorUndoRecord(UNDO_INS_SPAN, at, 0, n, (char *)&ref, sizeof(ref));
+  E.dirty++;
+}
+
+/* Swaps the chars of the rows listed in rows, in ascending order,
+ * with the chars of the n rows of a span, which own theirs. The 
+ * rows stay where they are, so only their contents are reported
+ * as changed, and they are rendered again when next drawn. The
+ * span is kept by the undo log, as swapping again undoes it */
+void editorSwapSpanRows(espan *span, const int *rows, int n) {
+  if (n <= 0) return;
+  size_t size = sizeof(undoSpanRef) + sizeof(int) * n;
+  char *data = malloc(size);
+  undoSpanRef ref = { span, 0, span->bytes };
+  memcpy(data, &ref, sizeof(ref));
+  memcpy(data + sizeof(ref), rows, sizeof(int) * n);
+  editorUndoRecord(UNDO_SWAP_SPAN, rows[0], 0, n, data, size);
+  free(data);
+
+  span->bytes = 0;
+  int k, run = 0;
+  for (k = 0; k < n; k++) {
+    erow *row = &E.row[rows[k]];
+    erow *other = &span->rows[k];
+    editorRowWritable(row);
+    editorRowBytes(row, -1);
+    char *chars = row->chars;
+    int rowsize = row->size;
+    row->chars = other->chars;
+    row->size = other->size;
+    other->chars = chars;
+    other->size = rowsize;
+    span->bytes += other->size;
+    editorRowBytes(row, 1);
+
+    editorRowCache(row, -1);
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+
+    /* Rows next to each other are reported in one go */
+    if (k == n - 1 || rows[k + 1] != rows[k] + 1) {
+      editorNotify(CHANGE_MODIFY, rows[run], rows[k] - rows[run] + 1);
+      run = k + 1;
+    }
+  }
+  E.dirty++;
+}
+
+/* Takes n rows out of the editor and moves them, by pointer, 
+ * into a new span. One reference to the span is returned to the
+ * caller, who releases it when done */
+espan *editorDetachRows(int at, int n) {
+  if (at < 0 || at >= E.numrows || n <= 0) return spanNew(0);
+  if (n > E.numrows - at) n = E.numrows - at;
+
+  espan *span = spanNew(n);
+  int j;
+  for (j = 0; j < n; j++) {
+    erow *row = &E.row[at + j];
+    editorRowCache(row, -1);
+    editorRowBytes(row, -1);
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    span->bytes += row->size;
+  }
+  memcpy(span->rows, &E.row[at], sizeof(erow) * n);
+
+  undoSpanRef ref = { span, 0, span->bytes };
+  editorUndoRecord(UNDO_DEL_SPAN, at, 0, n, (char *)&ref, sizeof(ref));
+
+  /*          To    /      From     /              numBytes            */
+  memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+  E.numrows -= n;
+  editorNotify(CHANGE_DELETE, at, n);
+  E.dirty++;
+  return span;
+}
+
 /* Deletes an erow at a given position */
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
+  editorUndoRecordRows(UNDO_DEL_ROWS, at, 1);
   editorFreeRow(&E.row[at]);
 
   /* Shifts all erows after E.row[at] back one to overwrite
@@ -390,12 +2266,40 @@ void editorDelRow(int at) {
    *          To    /      From     /              numBytes            */
   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
   E.numrows--;
+  editorNotify(CHANGE_DELETE, at, 1);
+  E.dirty++;
+}
+
+/* Deletes n erows starting at a given position. The rows are
+ * freed first and the rows after them are shifted back with 
+ * a single memmove(), instead of once per deleted row */
+void editorDelRows(int at, int n) {
+  if (at < 0 || at >= E.numrows || n <= 0) return;
+  if (n > E.numrows - at) n = E.numrows - at;
+
+  /* Large deletes hand the rows over to the undo log in a span,
+   * rather than copying their bytes into it */
+  if (n >= SPIKE_SPAN_ROWS && !E.undo.suspended) {
+    spanRelease(editorDetachRows(at, n));
+    return;
+  }
+  editorUndoRecordRows(UNDO_DEL_ROWS, at, n);
+
+  int j;
+  for (j = at; j < at + n; j++) editorFreeRow(&E.row[j]);
+
+  /*          To    /      From     /              numBytes            */
+  memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+  E.numrows -= n;
+  editorNotify(CHANGE_DELETE, at, n);
   E.dirty++;
 }
 
 /* Inserts a character into an erow at a given position */
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
   row->chars = realloc(row->chars, row->size + 2);
 
   /* Copies (row->size - at + 1) bytes from (row->chars[at])
@@ -405,12 +2309,38 @@ void editorRowInsertChar(erow *row, int at, int c) {
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
+  editorRowBytes(row, 1);
+  editorUpdateRow(row);
+
+  char ch = c;
+  editorUndoRecord(UNDO_INS_CHARS, row - E.row, at, 0, &ch, 1);
+  E.dirty++;
+}
+
+/* Inserts len bytes of s into an erow at a given position, 
+ * using one realloc(), one memmove() and one render update 
+ * for the whole string */
+void editorRowInsertChars(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
+  row->chars = realloc(row->chars, row->size + len + 1);
+
+  /*               To          /      From      /      numBytes     */
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorRowBytes(row, 1);
   editorUpdateRow(row);
+  editorUndoRecord(UNDO_INS_CHARS, row - E.row, at, 0, s, len);
   E.dirty++;
 }
 
 /* Appends a string to the end of a row */
 void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorUndoRecord(UNDO_INS_CHARS, row - E.row, row->size, 0, s, len);
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
 
   /* Reallocates a block of memory the size of the current row + 
    * the new string + 1 (for the null character at the end) */
@@ -421,6 +2351,7 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
+  editorRowBytes(row, 1);
   editorUpdateRow(row);
   E.dirty++;
 }
@@ -428,6 +2359,9 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
 /* Deletes a character in an erow at a given position */
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
+  editorUndoRecord(UNDO_DEL_CHARS, row - E.row, at, 0, &row->chars[at], 1);
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
 
   /* Copies (row->size - at) bytes from (row->chars[at + 1])
    * to (row->chars[at]). Shifts all bytes to the right of
@@ -435,12 +2369,70 @@ void editorRowDelChar(erow *row, int at) {
    *            To       /         From       /    numBytes   */
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
+  editorRowBytes(row, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Deletes n characters in an erow starting at a given position */
+void editorRowDelChars(erow *row, int at, int n) {
+  if (at < 0 || at >= row->size || n <= 0) return;
+  if (n > row->size - at) n = row->size - at;
+  editorUndoRecord(UNDO_DEL_CHARS, row - E.row, at, 0, &row->chars[at], n);
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
+
+  /*            To       /         From       /      numBytes     */
+  memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+  row->size -= n;
+  editorRowBytes(row, 1);
   editorUpdateRow(row);
   E.dirty++;
 }
 
+/* Splits a row in two at a given position. Everything from col
+ * onwards is moved onto a new row after it */
+void editorRowSplit(int at, int col) {
+  if (at < 0 || at >= E.numrows) return;
+  erow *row = &E.row[at];
+  if (col < 0 || col > row->size) col = row->size;
+
+  /* The new row and the truncation are recorded as one split */
+  E.undo.suspended++;
+  editorInsertRow(at + 1, &row->chars[col], row->size - col);
+  E.undo.suspended--;
+
+  /* row is reassigned, due to calling realloc() in 
+   * editorInsertRow(...), which might invalidate the 
+   * pointer */
+  row = &E.row[at];
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
+  row->size = col;
+  row->chars[row->size] = '\0';
+  editorRowBytes(row, 1);
+  editorUpdateRow(row);
+  editorUndoRecord(UNDO_SPLIT, at, col, 0, NULL, 0);
+}
+
+/* Joins a row with the row after it, which is the inverse of
+ * editorRowSplit(...) */
+void editorRowJoin(int at) {
+  if (at < 0 || at + 1 >= E.numrows) return;
+  int col = E.row[at].size;
+
+  E.undo.suspended++;
+  editorRowAppendString(&E.row[at], E.row[at + 1].chars, E.row[at + 1].size);
+  editorDelRow(at + 1);
+  E.undo.suspended--;
+  editorUndoRecord(UNDO_JOIN, at, col, 0, NULL, 0);
+}
+
 /* =============== Editor Operations =============== */
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_EDIT
+
 /* Takes in a character and uses editorRowInsertChar(...)
  * to insert that character into the position that the 
  * cursor is at */
@@ -451,70 +2443,2108 @@ void editorInsertChar(int c) {
   if (E.cy == E.numrows) {
     editorInsertRow(E.numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+/* Inserts the same character n times at the cursor as a 
+ * single batched insert */
+void editorInsertCharRepeat(int c, int n) {
+  if (n <= 0) return;
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+
+  char *s = malloc(n);
+  memset(s, c, n);
+  editorRowInsertChars(&E.row[E.cy], E.cx, s, n);
+  free(s);
+  E.cx += n;
+}
+
+/* Uses editorInsertRow(...) to either insert a new blank
+ * row or split the current line into two rows, depending
+ * on where the cursor is */
+void editorInsertNewline() {
+
+  /* If the cursor is at the beginning of a line, a new
+   * blank row will be inserted before the current line */
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+
+    /* Puts all of the characters on the current row that
+     * are on the right side of the cursor onto a new row, 
+     * after the current one (split into 2 rows) */
+    editorRowSplit(E.cy, E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+/* Inserts n newlines at the cursor. The current line is split
+ * once and the n - 1 blank lines between the two halves are
+ * inserted together */
+void editorInsertNewlineRepeat(int n) {
+  if (n <= 0) return;
+  editorInsertNewline();
+  if (n > 1) {
+    editorInsertBlankRows(E.cy, n - 1);
+    E.cy += n - 1;
+  }
+}
+
+/* Deletes n lines starting at the cursor's line */
+void editorDelLines(int n) {
+  if (E.cy >= E.numrows) return;
+  editorDelRows(E.cy, n);
+  E.cx = 0;
+}
+
+/* Takes in a character and uses editorRowDelChar(...)
+ * to delete the character that is to the left of the
+ * cursor */
+void editorDelChar() {
+  if (E.cy == E.numrows) return;         /* At the end of a file */
+  if (E.cx == 0 && E.cy == 0) return;    /* At the beginning of a file */
+
+  /* Sets row to the address of the erow the cursor
+   * is on */
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+
+    /* E.cx is set to the end of the line before the 
+     * current one */ 
+    E.cx = E.row[E.cy - 1].size;
+
+    /* Contents of current row are appended to the line
+     * before it, and the current row gets deleted */
+    editorRowJoin(E.cy - 1);
+    E.cy--;
+  }
+}
+
+/* Deletes n characters to the left of the cursor, each line break
+ * counting as one. The start of the deletion is found by walking
+ * back over whole rows, then everything up to the cursor is taken
+ * out with one editorDeleteText(...), so the rows after it are
+ * shifted once rather than once per line joined */
+void editorDelCharRepeat(int n) {
+  if (n <= 0 || E.cy == E.numrows) return;
+  int r = E.cy, c = E.cx;
+  while (n > 0) {
+    if (n <= c) {
+      c -= n;
+      break;
+    }
+    n -= c;
+    if (r == 0) {                        /* At the beginning of a file */
+      c = 0;
+      break;
+    }
+    r--;
+    c = E.row[r].size;
+    n--;
+  }
+  if (r == E.cy && c == E.cx) return;
+
+  editorDeleteText(r, c, E.cy, E.cx);
+  E.cy = r;
+  E.cx = c;
+}
+
+/* Takes the text between (r1, c1) and (r2, c2) out of the rows
+ * and returns it as a span, one row per line. Only the partial 
+ * first and last lines are copied, the whole rows in between are
+ * moved into the span by pointer */
+espan *editorCutText(int r1, int c1, int r2, int c2) {
+  if (r1 == r2) {
+    erow *row = &E.row[r1];
+    espan *span = spanFromString(&row->chars[c1], c2 - c1);
+    editorRowDelChars(row, c1, c2 - c1);
+    return span;
+  }
+
+  int middle = r2 - r1 - 1;
+  espan *span = spanNew(middle + 2);
+  erow *first = &span->rows[0];
+  erow *last = &span->rows[middle + 1];
+
+  first->size = E.row[r1].size - c1;
+  first->chars = malloc(first->size + 1);
+  memcpy(first->chars, &E.row[r1].chars[c1], first->size);
+  first->chars[first->size] = '\0';
+
+  last->size = c2;
+  last->chars = malloc(last->size + 1);
+  memcpy(last->chars, E.row[r2].chars, last->size);
+  last->chars[last->size] = '\0';
+  span->bytes = first->size + last->size;
+
+  if (middle > 0) {
+    espan *rows = editorDetachRows(r1 + 1, middle);
+    int j;
+    for (j = 0; j < middle; j++)
+      spanShareRow(rows, &rows->rows[j], &span->rows[j + 1]);
+    span->bytes += rows->bytes;
+    spanRelease(rows);
+  }
+
+  /* The last row is now right after the first one */
+  editorRowDelChars(&E.row[r1], c1, E.row[r1].size - c1);
+  editorRowDelChars(&E.row[r1 + 1], 0, c2);
+  editorRowJoin(r1);
+  return span;
+}
+
+/* Deletes the text between (r1, c1) and (r2, c2). The whole rows
+ * in between are removed with one editorDelRows(...), which frees
+ * them in a batch and shifts the rows after them once, and the 
+ * two partial rows at the edges are joined together */
+void editorDeleteText(int r1, int c1, int r2, int c2) {
+  if (r1 == r2) {
+    editorRowDelChars(&E.row[r1], c1, c2 - c1);
+    return;
+  }
+
+  editorDelRows(r1 + 1, r2 - r1 - 1);
+
+  /* The last row is now right after the first one */
+  editorRowDelChars(&E.row[r1], c1, E.row[r1].size - c1);
+  editorRowDelChars(&E.row[r1 + 1], 0, c2);
+  editorRowJoin(r1);
+}
+
+/* Returns the text between (r1, c1) and (r2, c2) as a span without
+ * changing it. Whole rows are not copied: their chars are handed
+ * over to the span, and the rows keep sharing them until they are
+ * next edited */
+espan *editorCopyText(int r1, int c1, int r2, int c2) {
+  if (r1 == r2) return spanFromString(&E.row[r1].chars[c1], c2 - c1);
+
+  int middle = r2 - r1 - 1;
+  espan *span = spanNew(middle + 2);
+  erow *first = &span->rows[0];
+  erow *last = &span->rows[middle + 1];
+
+  first->size = E.row[r1].size - c1;
+  first->chars = malloc(first->size + 1);
+  memcpy(first->chars, &E.row[r1].chars[c1], first->size);
+  first->chars[first->size] = '\0';
+
+  last->size = c2;
+  last->chars = malloc(last->size + 1);
+  memcpy(last->chars, E.row[r2].chars, last->size);
+  last->chars[last->size] = '\0';
+  span->bytes = first->size + last->size;
+
+  int j;
+  for (j = 0; j < middle; j++) {
+    erow *row = &E.row[r1 + 1 + j];
+    erow *copy = &span->rows[j + 1];
+    if (row->span) {
+      spanShareRow(row->span, row, copy);
+    } else {
+
+      /* The chars move from the owned to the shared count, the
+       * words they hold stay */
+      E.words.suspended++;
+      editorRowBytes(row, -1);
+      copy->size = row->size;
+      copy->chars = row->chars;
+      row->span = span;
+      span->refs++;
+      editorRowBytes(row, 1);
+      E.words.suspended--;
+    }
+    span->bytes += row->size;
+  }
+  return span;
+}
+
+/* Puts a span at the front of the kill ring, taking over the
+ * caller's reference to it. With append set, the span is added 
+ * onto the end of the most recent kill instead, so that several
+ * kills in a row can be yanked back as one */
+void editorKillRingPush(espan *span, int append) {
+  if (append && E.killlen > 0) {
+    espan *joined = spanConcat(E.killring[0], span);
+    spanRelease(E.killring[0]);
+    spanRelease(span);
+    E.killring[0] = joined;
+    return;
+  }
+
+  /* The oldest kill falls off the end of a full ring */
+  if (E.killlen == SPIKE_KILL_RING) spanRelease(E.killring[--E.killlen]);
+  memmove(&E.killring[1], &E.killring[0], sizeof(espan *) * E.killlen);
+  E.killring[0] = span;
+  E.killlen++;
+}
+
+/* Kills from the cursor to the end of the line, or the line 
+ * break if the cursor is already at the end. With a repeat 
+ * count of n, kills up to the start of the nth line below */
+void editorKillLine(int n) {
+  if (E.cy >= E.numrows) return;
+
+  int r2, c2;
+  if (n == 1) {
+    if (E.cx < E.row[E.cy].size) {
+      r2 = E.cy;
+      c2 = E.row[E.cy].size;
+    } else if (E.cy + 1 < E.numrows) {
+      r2 = E.cy + 1;
+      c2 = 0;
+    } else {
+      return;
+    }
+  } else {
+    r2 = E.cy + n;
+    c2 = 0;
+    if (r2 >= E.numrows) {
+      r2 = E.numrows - 1;
+      c2 = E.row[r2].size;
+    }
+  }
+  if (r2 == E.cy && c2 == E.cx) return;
+
+  editorKillRingPush(editorCutText(E.cy, E.cx, r2, c2), E.lastkill);
+}
+
+/* Inserts the nth most recent kill at the cursor. The first and
+ * last lines of the kill are merged into the line the cursor is 
+ * on, the lines in between are inserted as rows that share the 
+ * kill's chars */
+void editorYank(int n) {
+  if (E.killlen == 0) {
+    editorSetStatusMessage("Kill ring is empty");
+    return;
+  }
+  if (n > E.killlen) n = E.killlen;
+  espan *span = E.killring[n - 1];
+
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+
+  int r = E.cy;
+  int k = span->numrows;
+  erow *first = &span->rows[0];
+  erow *last = &span->rows[k - 1];
+  if (k == 1) {
+    if (first->size) editorRowInsertChars(&E.row[r], E.cx, first->chars, first->size);
+    E.cx += first->size;
+    return;
+  }
+
+  editorRowSplit(r, E.cx);
+  if (first->size) editorRowInsertChars(&E.row[r], E.cx, first->chars, first->size);
+  if (k > 2) editorInsertSpanRows(r + 1, span, 1, k - 2);
+  if (last->size) editorRowInsertChars(&E.row[r + k - 1], 0, last->chars, last->size);
+  E.cy = r + k - 1;
+  E.cx = last->size;
+}
+
+/* Sets the mark at the cursor, or clears it if it is set, which
+ * starts or ends selecting a region */
+void editorToggleMark() {
+  if (E.markset) {
+    E.markset = 0;
+    editorSetStatusMessage("Mark cleared");
+  } else {
+    E.markset = 1;
+    E.markx = E.cx;
+    E.marky = E.cy;
+    editorSetStatusMessage("Mark set");
+  }
+}
+
+/* Gets the region between the mark and the cursor, start first.
+ * Ends that are past the last row are pulled back to the end of
+ * the last row. Returns 0 if there is no region */
+int editorGetRegion(int *r1, int *c1, int *r2, int *c2) {
+  if (!E.markset || E.numrows == 0) return 0;
+
+  int ay = E.marky, ax = E.markx;
+  int by = E.cy, bx = E.cx;
+  if (ay > by || (ay == by && ax > bx)) {
+    int t;
+    t = ay; ay = by; by = t;
+    t = ax; ax = bx; bx = t;
+  }
+  if (ay >= E.numrows) {
+    ay = E.numrows - 1;
+    ax = E.row[ay].size;
+  }
+  if (by >= E.numrows) {
+    by = E.numrows - 1;
+    bx = E.row[by].size;
+  }
+  if (ax > E.row[ay].size) ax = E.row[ay].size;
+  if (bx > E.row[by].size) bx = E.row[by].size;
+
+  *r1 = ay; *c1 = ax;
+  *r2 = by; *c2 = bx;
+  return 1;
+}
+
+/* Copies (cut = 0), cuts (cut = 1) or deletes (cut = 2) the 
+ * region. Copies and cuts go to the kill ring */
+void editorRegionCommand(int cut) {
+  int r1, c1, r2, c2;
+  if (!editorGetRegion(&r1, &c1, &r2, &c2)) {
+    editorSetStatusMessage("No region selected (Ctrl-Space sets the mark)");
+    return;
+  }
+
+  if (cut == 0) {
+    editorKillRingPush(editorCopyText(r1, c1, r2, c2), 0);
+    editorSetStatusMessage("Copied %d lines", r2 - r1 + 1);
+  } else if (cut == 1) {
+    editorKillRingPush(editorCutText(r1, c1, r2, c2), 0);
+  } else {
+    editorDeleteText(r1, c1, r2, c2);
+  }
+  E.markset = 0;
+  if (cut) editorSetCursor(r1, c1);
+}
+
+/* =============== Multiple Cursors =============== */
+
+/* Orders cursors by row, then by column */
+int cursorCmp(const void *a, const void *b) {
+  const ecursor *x = a, *y = b;
+  if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+  if (x->cx != y->cx) return x->cx < y->cx ? -1 : 1;
+  return 0;
+}
+
+/* Adds an extra cursor. Cursors on the same spot as another one
+ * are merged away by editorSortCursors() */
+void editorAddCursor(int cx, int cy) {
+  if (E.numcursors == E.cursorcap) {
+    E.cursorcap = E.cursorcap ? E.cursorcap * 2 : 16;
+    E.cursors = realloc(E.cursors, sizeof(ecursor) * E.cursorcap);
+  }
+  E.cursors[E.numcursors].cx = cx;
+  E.cursors[E.numcursors].cy = cy;
+  E.numcursors++;
+}
+
+/* Removes every extra cursor, leaving only the main one */
+void editorClearCursors() {
+  E.numcursors = 0;
+}
+
+/* Sorts the extra cursors and drops the ones that ended up on
+ * top of another cursor or the main cursor */
+void editorSortCursors() {
+  qsort(E.cursors, E.numcursors, sizeof(ecursor), cursorCmp);
+  int i, n = 0;
+  for (i = 0; i < E.numcursors; i++) {
+    ecursor *c = &E.cursors[i];
+    if (c->cx == E.cx && c->cy == E.cy) continue;
+    if (n > 0 && cursorCmp(c, &E.cursors[n - 1]) == 0) continue;
+    E.cursors[n++] = *c;
+  }
+  E.numcursors = n;
+}
+
+/* Gathers the main cursor and the extra ones into one sorted
+ * array, with the main cursor marked by *primary */
+ecursor *editorAllCursors(int *count, int *primary) {
+  int n = E.numcursors + 1;
+  ecursor *all = malloc(sizeof(ecursor) * n);
+  ecursor main = { E.cx, E.cy };
+
+  /* The extra cursors are already sorted, so the main cursor 
+   * only has to be slotted into place */
+  int i, j = 0;
+  *primary = -1;
+  for (i = 0; i < E.numcursors; i++) {
+    if (*primary == -1 && cursorCmp(&main, &E.cursors[i]) < 0) {
+      *primary = j;
+      all[j++] = main;
+    }
+    all[j++] = E.cursors[i];
+  }
+  if (*primary == -1) {
+    *primary = j;
+    all[j++] = main;
+  }
+  *count = n;
+  return all;
+}
+
+/* Stores the cursors of an array made by editorAllCursors() back */
+void editorStoreCursors(ecursor *all, int count, int primary) {
+  int i;
+  E.numcursors = 0;
+  for (i = 0; i < count; i++) {
+    if (i == primary) {
+      E.cx = all[i].cx;
+      E.cy = all[i].cy;
+    } else {
+      E.cursors[E.numcursors++] = all[i];
+    }
+  }
+  free(all);
+  editorSortCursors();
+}
+
+/* Inserts s at the n sorted columns cols of a row, in one pass 
+ * that moves each segment of the row straight to its final 
+ * place, working from right to left. The row is rebuilt once */
+void editorRowMultiInsert(int at, int *cols, int n, const char *s, int len) {
+  erow *row = &E.row[at];
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
+  row->chars = realloc(row->chars, row->size + n * len + 1);
+
+  int end = row->size;
+  int i;
+  for (i = n - 1; i >= 0; i--) {
+    int shift = (i + 1) * len;
+    memmove(&row->chars[cols[i] + shift], &row->chars[cols[i]], end - cols[i]);
+    memcpy(&row->chars[cols[i] + i * len], s, len);
+    end = cols[i];
+  }
+  row->size += n * len;
+  row->chars[row->size] = '\0';
+  editorRowBytes(row, 1);
+
+  /* Recorded as the same inserts made one after another from
+   * left to right, which is what undo expects */
+  for (i = 0; i < n; i++)
+    editorUndoRecord(UNDO_INS_CHARS, at, cols[i] + i * len, 0, s, len);
+
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Deletes the characters at the n sorted, distinct columns cols 
+ * of a row in one left to right pass. The row is rebuilt once */
+void editorRowMultiDelete(int at, int *cols, int n) {
+  erow *row = &E.row[at];
+  editorRowWritable(row);
+  editorRowBytes(row, -1);
+
+  int i;
+  for (i = 0; i < n; i++)
+    editorUndoRecord(UNDO_DEL_CHARS, at, cols[i] - i, 0, &row->chars[cols[i]], 1);
+
+  int dst = cols[0];
+  for (i = 0; i < n; i++) {
+    int from = cols[i] + 1;
+    int to = i + 1 < n ? cols[i + 1] : row->size;
+    memmove(&row->chars[dst], &row->chars[from], to - from);
+    dst += to - from;
+  }
+  row->size -= n;
+  row->chars[row->size] = '\0';
+  editorRowBytes(row, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Types s at every cursor. Cursors are handled a row at a time,
+ * so a row with many cursors on it is only rebuilt once */
+void editorMultiInsert(const char *s, int len) {
+  int count, primary;
+  ecursor *all = editorAllCursors(&count, &primary);
+  int *cols = malloc(sizeof(int) * count);
+
+  /* A cursor past the last row needs a row to type into */
+  if (all[count - 1].cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+  int i = 0;
+  while (i < count) {
+    int at = all[i].cy;
+    int j, n = 0;
+    for (j = i; j < count && all[j].cy == at; j++) cols[n++] = all[j].cx;
+    editorRowMultiInsert(at, cols, n, s, len);
+
+    /* Cursors move along by everything inserted up to them */
+    for (j = 0; j < n; j++) all[i + j].cx += (j + 1) * len;
+    i += n;
+  }
+  free(cols);
+  editorStoreCursors(all, count, primary);
+}
+
+/* Deletes the character before (or, with forward set, under) 
+ * every cursor. Deletions never reach across a line break, so
+ * cursors at the start (end) of a line do nothing */
+void editorMultiDelete(int forward) {
+  int count, primary;
+  ecursor *all = editorAllCursors(&count, &primary);
+  int *cols = malloc(sizeof(int) * count);
+
+  int i = 0;
+  while (i < count) {
+    int at = all[i].cy;
+    int j, n = 0, removed = 0;
+    int end = i;
+    while (end < count && all[end].cy == at) end++;
+    if (at >= E.numrows) {
+      i = end;
+      continue;
+    }
+
+    for (j = i; j < end; j++) {
+      int col = forward ? all[j].cx : all[j].cx - 1;
+      if (col < 0 || col >= E.row[at].size) continue;
+      if (n > 0 && cols[n - 1] == col) continue;
+      cols[n++] = col;
+    }
+    if (n > 0) editorRowMultiDelete(at, cols, n);
+
+    /* Cursors move back by the deletions made before them */
+    int k = 0;
+    for (j = i; j < end; j++) {
+      while (k < n && cols[k] < all[j].cx) {
+	k++;
+	removed++;
+      }
+      all[j].cx -= removed;
+    }
+    i = end;
+  }
+  free(cols);
+  editorStoreCursors(all, count, primary);
+}
+
+/* Moves every cursor as editorMoveCursor(...) would move the main one */
+void editorMultiMove(int key) {
+  int saved_cx = E.cx, saved_cy = E.cy;
+  int i;
+  for (i = 0; i < E.numcursors; i++) {
+    E.cx = E.cursors[i].cx;
+    E.cy = E.cursors[i].cy;
+    if (key == HOME_KEY) E.cx = 0;
+    else if (key == END_KEY) E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+    else editorMoveCursor(key);
+    E.cursors[i].cx = E.cx;
+    E.cursors[i].cy = E.cy;
+  }
+  E.cx = saved_cx;
+  E.cy = saved_cy;
+}
+
+/* Adds a cursor at the next match of the region (if it is on one 
+ * line) or of the word under the cursor, after the last cursor 
+ * that was added. The new cursor sits at the same spot within the
+ * match as the main cursor does within its word */
+void editorAddCursorAtNextMatch() {
+  if (E.cy >= E.numrows) return;
+  erow *row = &E.row[E.cy];
+
+  int start, end;
+  int r1, c1, r2, c2;
+  if (editorGetRegion(&r1, &c1, &r2, &c2) && r1 == r2 && c1 < c2) {
+    start = c1;
+    end = c2;
+    E.markset = 0;
+  } else {
+    start = end = E.cx;
+    while (start > 0 && !is_separator(row->chars[start - 1])) start--;
+    while (end < row->size && !is_separator(row->chars[end])) end++;
+  }
+  if (start == end) {
+    editorSetStatusMessage("No word under the cursor");
+    return;
+  }
+
+  char *word = malloc(end - start + 1);
+  memcpy(word, &row->chars[start], end - start);
+  word[end - start] = '\0';
+  int offset = E.cx - start;
+  if (offset < 0) offset = 0;
+  if (offset > end - start) offset = end - start;
+
+  /* Searches on from the last cursor that was added, wrapping
+   * around at the end of the file */
+  int fromy = E.cy, fromx = end;
+  if (E.numcursors > 0) {
+    fromy = E.lastcursor.cy;
+    fromx = E.lastcursor.cx - offset + (end - start);
+  }
+
+  int i;
+  for (i = 0; i <= E.numrows; i++) {
+    int y = (fromy + i) % E.numrows;
+    erow *r = &E.row[y];
+    int x = (i == 0 && fromx <= r->size) ? fromx : 0;
+    char *match = strstr(&r->chars[x], word);
+    if (match) {
+      int cx = match - r->chars + offset;
+      if ((y == E.cy && cx == E.cx)) break;
+      editorAddCursor(cx, y);
+      E.lastcursor.cx = cx;
+      E.lastcursor.cy = y;
+      editorSortCursors();
+      editorSetStatusMessage("%d cursors", E.numcursors + 1);
+      free(word);
+      return;
+    }
+  }
+  editorSetStatusMessage("No more matches for \"%s\"", word);
+  free(word);
+}
+
+/* Returns the index of the first extra cursor on a given row, 
+ * or of the first one after it if there are none on the row */
+int editorFirstCursorOnRow(int row) {
+  int lo = 0, hi = E.numcursors;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (E.cursors[mid].cy < row) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* Handles a key while there are extra cursors. Typing and deleting
+ * are done at every cursor, and moves are applied to the extra 
+ * cursors before the main cursor is moved as usual. Returns 1 if
+ * the key was handled here. Commands that do not make sense with
+ * many cursors drop the extra ones */
+int editorMultiCursorKey(int c, int count) {
+  switch (c) {
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+      while (count--) editorMultiDelete(0);
+      return 1;
+
+    case DEL_KEY:
+      while (count--) editorMultiDelete(1);
+      return 1;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case WORD_LEFT:
+    case WORD_RIGHT:
+    case PARA_UP:
+    case PARA_DOWN:
+    case HOME_KEY:
+    case END_KEY:
+      while (count--) editorMultiMove(c);
+      editorSortCursors();
+      return 0;
+
+    case CTRL_KEY('t'):
+    case CTRL_KEY('e'):
+    case CTRL_KEY('s'):
+    case CTRL_KEY('q'):
+    case CTRL_KEY('l'):
+      return 0;
+  }
+
+  if (c == '\t' || (c >= ' ' && c < BACKSPACE)) {
+    char *s = malloc(count);
+    memset(s, c, count);
+    editorMultiInsert(s, count);
+    free(s);
+    return 1;
+  }
+
+  editorClearCursors();
+  return 0;
+}
+
+/* Adds a cursor on every line of the region, in the same screen
+ * column as the main cursor */
+void editorAddCursorsOnRegion() {
+  int r1, c1, r2, c2;
+  if (!editorGetRegion(&r1, &c1, &r2, &c2)) {
+    editorSetStatusMessage("No region selected (Ctrl-Space sets the mark)");
+    return;
+  }
+  int rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+  int y;
+  for (y = r1; y <= r2; y++) {
+    if (y == E.cy) continue;
+    editorAddCursor(editorRowRxToCx(&E.row[y], rx), y);
+  }
+  E.markset = 0;
+  editorSortCursors();
+  editorSetStatusMessage("%d cursors", E.numcursors + 1);
+}
+
+/* =============== Line Commands =============== */
+
+/* Moves n rows starting at at so that row k ends up holding what
+ * was row perm[k], or the other way around with inverse set. Only 
+ * the erow structs move, the bytes of the rows stay where they 
+ * are. The permutation is the undo record */
+void editorPermuteRows(int at, int n, const int *perm, int inverse) {
+  editorUndoRecord(inverse ? UNDO_UNPERMUTE : UNDO_PERMUTE, at, 0, n,
+		   (const char *)perm, sizeof(int) * n);
+
+  erow *old = malloc(sizeof(erow) * n);
+  int *moved = malloc(sizeof(int) * n);
+  memcpy(old, &E.row[at], sizeof(erow) * n);
+  int k;
+  if (inverse) {
+    for (k = 0; k < n; k++) {
+      E.row[at + perm[k]] = old[k];
+      moved[k] = perm[k];
+    }
+  } else {
+    for (k = 0; k < n; k++) {
+      E.row[at + k] = old[perm[k]];
+      moved[perm[k]] = k;
+    }
+  }
+  free(old);
+
+  /* Listeners are told where each row went, so that anchors and
+   * folds can follow their text */
+  L.moved = moved;
+  editorNotify(CHANGE_PERMUTE, at, n);
+  L.moved = NULL;
+  free(moved);
+  E.dirty++;
+}
+
+/* What a row is sorted by. Keys are worked out once per row, so 
+ * the comparisons do not have to look for fields or parse numbers */
+typedef struct sortKey {
+  const char *s;        /* Start of the key field */
+  int len;              /* Bytes from s to the end of the row, as with sort -k */
+  int idx;              /* Row, relative to the first sorted row */
+  double num;           /* Value of the field, for numeric sorts */
+} sortKey;
+
+/* A sort spread over the thread pool. The keys are split into 
+ * chunks that are sorted on their own, after which neighbouring
+ * runs are merged, in parallel, until one run is left */
+struct sortJob {
+  sortKey *keys;
+  sortKey *tmp;
+  int at;               /* First row being sorted */
+  int n;
+  int field;            /* Field sorted on, 0 for the whole row */
+  int numeric;
+  int chunk;            /* Keys per chunk, or per run while merging */
+};
+
+/* Compares keys by number or by bytes. Keys that compare equal 
+ * stay in the order their rows were in */
+int sortCmp(const sortKey *a, const sortKey *b, int numeric) {
+  if (numeric) {
+    if (a->num < b->num) return -1;
+    if (a->num > b->num) return 1;
+  } else {
+    int len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->s, b->s, len);
+    if (cmp != 0) return cmp;
+    if (a->len != b->len) return a->len - b->len;
+  }
+  return a->idx - b->idx;
+}
+
+/* Finds the key of every row in a chunk. Fields are separated by
+ * runs of blanks, like sort(1) does by default */
+void sortKeysTask(void *arg, int task) {
+  struct sortJob *job = arg;
+  int lo = task * job->chunk;
+  int hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+  int j;
+  for (j = lo; j < hi; j++) {
+    erow *row = &E.row[job->at + j];
+    const char *p = row->chars;
+    const char *end = row->chars + row->size;
+    int f;
+    for (f = 1; f < job->field; f++) {
+      while (p < end && isblank((unsigned char)*p)) p++;
+      while (p < end && !isblank((unsigned char)*p)) p++;
+    }
+    if (job->field > 0) while (p < end && isblank((unsigned char)*p)) p++;
+
+    sortKey *key = &job->keys[j];
+    key->s = p;
+    key->len = end - p;
+    key->idx = j;
+    key->num = job->numeric ? strtod(p, NULL) : 0;
+  }
+}
+
+/* Merges the sorted runs a[lo..mid) and a[mid..hi) through tmp */
+void sortMerge(sortKey *a, sortKey *tmp, int lo, int mid, int hi, int numeric) {
+  if (mid >= hi || sortCmp(&a[mid - 1], &a[mid], numeric) <= 0) return;
+  int i = lo, j = mid, k = lo;
+  while (i < mid && j < hi) {
+    if (sortCmp(&a[j], &a[i], numeric) < 0) tmp[k++] = a[j++];
+    else tmp[k++] = a[i++];
+  }
+  while (i < mid) tmp[k++] = a[i++];
+  while (j < hi) tmp[k++] = a[j++];
+  memcpy(&a[lo], &tmp[lo], sizeof(sortKey) * (hi - lo));
+}
+
+/* Sorts a[lo..hi) with a merge sort that falls back to an
+ * insertion sort for short runs */
+void sortRange(sortKey *a, sortKey *tmp, int lo, int hi, int numeric) {
+  if (hi - lo <= 16) {
+    int j;
+    for (j = lo + 1; j < hi; j++) {
+      sortKey key = a[j];
+      int k = j;
+      while (k > lo && sortCmp(&key, &a[k - 1], numeric) < 0) {
+	a[k] = a[k - 1];
+	k--;
+      }
+      a[k] = key;
+    }
+    return;
+  }
+  int mid = lo + (hi - lo) / 2;
+  sortRange(a, tmp, lo, mid, numeric);
+  sortRange(a, tmp, mid, hi, numeric);
+  sortMerge(a, tmp, lo, mid, hi, numeric);
+}
+
+/* Sorts one chunk */
+void sortChunkTask(void *arg, int task) {
+  struct sortJob *job = arg;
+  int lo = task * job->chunk;
+  int hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+  sortRange(job->keys, job->tmp, lo, hi, job->numeric);
+}
+
+/* Merges one pair of neighbouring runs */
+void sortMergeTask(void *arg, int task) {
+  struct sortJob *job = arg;
+  int lo = task * 2 * job->chunk;
+  int mid = lo + job->chunk;
+  int hi = mid + job->chunk < job->n ? mid + job->chunk : job->n;
+  if (mid < job->n) sortMerge(job->keys, job->tmp, lo, mid, hi, job->numeric);
+}
+
+/* Gets the rows a line command works on: the rows of the region,
+ * or the whole file if no region is selected */
+void editorLineRange(int *at, int *n) {
+  int r1, c1, r2, c2;
+  if (editorGetRegion(&r1, &c1, &r2, &c2)) {
+    if (c2 == 0 && r2 > r1) r2--;
+    *at = r1;
+    *n = r2 - r1 + 1;
+  } else {
+    *at = 0;
+    *n = E.numrows;
+  }
+}
+
+/* Sorts the lines on the given field (0 for the whole line), as
+ * text or by number */
+void editorSortLines(int field, int numeric) {
+  struct sortJob job;
+  editorLineRange(&job.at, &job.n);
+  if (job.n < 2) return;
+
+  job.keys = malloc(sizeof(sortKey) * job.n);
+  job.tmp = malloc(sizeof(sortKey) * job.n);
+  job.field = field;
+  job.numeric = numeric;
+
+  /* At least a few chunks per thread, so that a slow chunk does 
+   * not hold up the others, but none so small that the merging
+   * is most of the work */
+  int chunks = poolThreads() * 4;
+  job.chunk = (job.n + chunks - 1) / chunks;
+  if (job.chunk < 4096) job.chunk = 4096;
+  chunks = (job.n + job.chunk - 1) / job.chunk;
+
+  poolRun(sortKeysTask, &job, chunks);
+  poolRun(sortChunkTask, &job, chunks);
+  while (job.chunk < job.n) {
+    int pairs = (job.n + 2 * job.chunk - 1) / (2 * job.chunk);
+    poolRun(sortMergeTask, &job, pairs);
+    job.chunk *= 2;
+  }
+
+  int *perm = (int *)job.tmp;
+  int j;
+  for (j = 0; j < job.n; j++) perm[j] = job.keys[j].idx;
+  editorPermuteRows(job.at, job.n, perm, 0);
+  free(job.keys);
+  free(job.tmp);
+
+  E.markset = 0;
+  editorSetStatusMessage("Sorted %d lines", job.n);
+}
+
+/* Reverses the order of the lines */
+void editorReverseLines() {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 2) return;
+
+  int *perm = malloc(sizeof(int) * n);
+  int j;
+  for (j = 0; j < n; j++) perm[j] = n - 1 - j;
+  editorPermuteRows(at, n, perm, 0);
+  free(perm);
+  E.markset = 0;
+}
+
+/* Deletes lines that are the same as the line before them. The
+ * duplicates are first moved, in order, to the end of the range
+ * and then deleted together, so that undoing puts them back with
+ * one permutation and one row insert */
+void editorUniqLines() {
+  int at, n;
+  editorLineRange(&at, &n);
+  if (n < 2) return;
+
+  int *perm = malloc(sizeof(int) * n);
+  int kept = 0, dups = 0;
+  int j;
+  for (j = 0; j < n; j++) {
+    erow *row = &E.row[at + j];
+    erow *prev = row - 1;
+    if (j > 0 && row->size == prev->size && memcmp(row->chars, prev->chars, row->size) == 0)
+      perm[n - 1 - dups++] = j;
+    else
+      perm[kept++] = j;
+  }
+
+  /* The duplicates were filled in from the end backwards */
+  for (j = 0; j < dups / 2; j++) {
+    int tmp = perm[kept + j];
+    perm[kept + j] = perm[n - 1 - j];
+    perm[n - 1 - j] = tmp;
+  }
+
+  if (dups > 0) {
+    editorPermuteRows(at, n, perm, 0);
+    editorDelRows(at + kept, dups);
+  }
+  free(perm);
+
+  E.markset = 0;
+  if (E.cy >= E.numrows) E.cy = E.numrows ? E.numrows - 1 : 0;
+  E.cx = 0;
+  editorSetStatusMessage("Deleted %d duplicate lines", dups);
+}
+
+/* A retab spread over the thread pool. Every task works out the 
+ * new chars of a chunk of rows, leaving NULL for rows that stay
+ * as they are */
+struct retabJob {
+  int at;
+  int n;
+  int chunk;
+  int indent;           /* Only the indentation is turned into tabs */
+  char **chars;
+  int *sizes;
+};
+
+/* Expands every tab of a row into spaces. Rows without tabs are 
+ * found with memchr(), which looks at many bytes at a time */
+char *retabExpand(erow *row, int *size) {
+  if (memchr(row->chars, '\t', row->size) == NULL) return NULL;
+
+  *size = editorRowCxToRx(row, row->size);
+  char *chars = malloc(*size + 1);
+  int rx = 0, j;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      chars[rx++] = ' ';
+      while (rx % SPIKE_TAB_STOP != 0) chars[rx++] = ' ';
+    } else {
+      chars[rx++] = row->chars[j];
+    }
+  }
+  chars[rx] = '\0';
+  return chars;
+}
+
+/* Rewrites the indentation of a row as tabs, followed by the 
+ * spaces left over that do not reach the next tab stop */
+char *retabIndent(erow *row, int *size) {
+  int w = 0;
+  while (w < row->size && (row->chars[w] == ' ' || row->chars[w] == '\t')) w++;
+
+  int width = editorRowCxToRx(row, w);
+  int tabs = width / SPIKE_TAB_STOP;
+  int spaces = width % SPIKE_TAB_STOP;
+  int j;
+  for (j = 0; j < w; j++) {
+    if (row->chars[j] != (j < tabs ? '\t' : ' ')) break;
+  }
+  if (j == w && w == tabs + spaces) return NULL;
+
+  *size = tabs + spaces + row->size - w;
+  char *chars = malloc(*size + 1);
+  memset(chars, '\t', tabs);
+  memset(&chars[tabs], ' ', spaces);
+  memcpy(&chars[tabs + spaces], &row->chars[w], row->size - w + 1);
+  return chars;
+}
+
+/* Retabs one chunk of rows */
+void retabTask(void *arg, int task) {
+  struct retabJob *job = arg;
+  int lo = task * job->chunk;
+  int hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+  int j;
+  for (j = lo; j < hi; j++) {
+    erow *row = &E.row[job->at + j];
+    if (job->indent) job->chars[j] = retabIndent(row, &job->sizes[j]);
+    else job->chars[j] = retabExpand(row, &job->sizes[j]);
+  }
+}
+
+/* Expands tabs into spaces (indent = 0) or turns indentation into
+ * tabs (indent = 1) on the lines of the region or the whole file. 
+ * The new rows are worked out in parallel. Only the rows that did
+ * change then get their chars swapped, in place, with a span of 
+ * the new ones, which the undo log keeps to swap them back. No row
+ * bytes are copied into the log, the rows that stay the same are
+ * not touched at all, and the rest are only rendered when drawn */
+void editorRetab(int indent) {
+  struct retabJob job;
+  editorLineRange(&job.at, &job.n);
+  if (job.n == 0) return;
+
+  job.indent = indent;
+  job.chars = malloc(sizeof(char *) * job.n);
+  job.sizes = malloc(sizeof(int) * job.n);
+  int chunks = poolThreads() * 4;
+  job.chunk = (job.n + chunks - 1) / chunks;
+  if (job.chunk < 4096) job.chunk = 4096;
+  chunks = (job.n + job.chunk - 1) / job.chunk;
+  poolRun(retabTask, &job, chunks);
+
+  int changed = 0;
+  int j;
+  for (j = 0; j < job.n; j++) {
+    if (job.chars[j]) changed++;
+  }
+
+  if (changed > 0) {
+    espan *span = spanNew(changed);
+    int *rows = malloc(sizeof(int) * changed);
+    int k = 0;
+    for (j = 0; j < job.n; j++) {
+      if (job.chars[j] == NULL) continue;
+      span->rows[k].size = job.sizes[j];
+      span->rows[k].chars = job.chars[j];
+      span->bytes += job.sizes[j];
+      rows[k++] = job.at + j;
+    }
+    editorSwapSpanRows(span, rows, changed);
+    spanRelease(span);
+    free(rows);
+
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  }
+  free(job.chars);
+  free(job.sizes);
+
+  E.markset = 0;
+  editorSetStatusMessage("Retabbed %d lines", changed);
+}
+
+/* Reads the key after the Ctrl-O prefix and runs the line 
+ * command it stands for */
+void editorLineCommand() {
+  editorSetStatusMessage("Lines: s = sort | n = numeric sort | f = sort on field | "
+			 "u = unique | r = reverse | t = tabs to spaces | i = indent with tabs");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's': editorSortLines(0, 0); break;
+    case 'n': editorSortLines(0, 1); break;
+    case 'u': editorUniqLines(); break;
+    case 'r': editorReverseLines(); break;
+    case 't': editorRetab(0); break;
+    case 'i': editorRetab(1); break;
+    case 'f': {
+      char *field = editorPrompt("Sort on field (n for numbers, e.g. 2n): %s", NULL);
+      if (field == NULL) break;
+      int f = atoi(field);
+      if (f > 0) editorSortLines(f, strchr(field, 'n') != NULL);
+      else editorSetStatusMessage("Fields are numbered from 1");
+      free(field);
+      break;
+    }
+  }
+}
+
+/* =============== Completion =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_WORDS
+
+/* Drops the candidates of the last completion */
+void editorCompletionClear() {
+  int j;
+  for (j = 0; j < E.completion.n; j++) free(E.completion.cands[j]);
+  E.completion.n = 0;
+}
+
+/* Completes the word before the cursor with the most frequent 
+ * word in the file that starts with it. Pressing Ctrl-N again 
+ * right away replaces it with the next candidate, and after the
+ * last one the word is put back the way it was typed */
+void editorComplete() {
+  struct completion *cp = &E.completion;
+
+  if (E.lastcomplete && cp->n > 0 && cp->row == E.cy && cp->row < E.numrows) {
+    erow *row = &E.row[cp->row];
+    int cur = cp->next == 0 ? cp->n : cp->next - 1;
+    int curlen = cur < cp->n ? (int)strlen(cp->cands[cur]) : cp->plen;
+    editorRowDelChars(row, cp->col + cp->plen, curlen - cp->plen);
+    if (cp->next < cp->n) {
+      const char *w = cp->cands[cp->next];
+      editorRowInsertChars(row, cp->col + cp->plen, &w[cp->plen], strlen(w) - cp->plen);
+      E.cx = cp->col + strlen(w);
+      editorSetStatusMessage("Completion %d of %d", cp->next + 1, cp->n);
+      cp->next++;
+    } else {
+      E.cx = cp->col + cp->plen;
+      editorSetStatusMessage("Back to the word as typed");
+      cp->next = 0;
+    }
+    return;
+  }
+
+  editorCompletionClear();
+  if (E.cy >= E.numrows) return;
+  erow *row = &E.row[E.cy];
+  int col = E.cx;
+  while (col > 0 && isWordChar((unsigned char)row->chars[col - 1])) col--;
+  if (col == E.cx) {
+    editorSetStatusMessage("No word to complete before the cursor");
+    return;
+  }
+
+  int ready = editorWordsReady(&E);
+  cp->row = E.cy;
+  cp->col = col;
+  cp->plen = E.cx - col;
+  cp->n = wordIndexTop(&E.words, &row->chars[col], cp->plen, cp->cands, SPIKE_COMPLETIONS);
+  if (cp->n == 0) {
+    editorSetStatusMessage(ready ? "No completions" : "No completions yet, still indexing");
+    return;
+  }
+
+  const char *w = cp->cands[0];
+  editorRowInsertChars(row, E.cx, &w[cp->plen], strlen(w) - cp->plen);
+  E.cx = col + strlen(w);
+  cp->next = 1;
+  editorSetStatusMessage("Completion 1 of %d%s", cp->n, ready ? "" : " (still indexing)");
+}
+
+/* =============== Anchors =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_EDIT
+
+/* Positions that stay with their text while rows are inserted and
+ * deleted above them. Inserts and deletes only append an entry to
+ * the shift log of the buffer, and an anchor replays the entries
+ * it has not seen yet when it is next looked at. Typing, which 
+ * only modifies rows, costs the anchors nothing */
+
+/* Records inserts, deletes and reorderings for the anchors to 
+ * catch up on. A reordering keeps its own copy of where the rows
+ * went, as L.moved only lasts as long as the notification */
+void editorAnchorsChanged(int type, int at, int n) {
+  if (type == CHANGE_MODIFY) return;
+  struct shiftLog *sl = &E.shifts;
+
+  /* A full log is emptied by bringing every anchor up to date */
+  if (sl->len == SPIKE_SHIFT_LOG) {
+    int j;
+    for (j = 0; j < E.numbookmarks; j++) editorAnchorResolve(&E.bookmarks[j].anchor);
+    for (j = 0; j < E.numjumps; j++) editorAnchorResolve(&E.jumps[j]);
+    for (j = 0; j < sl->len; j++) free(sl->entries[j].moved);
+    sl->base += sl->len;
+    sl->len = 0;
+  }
+
+  if (sl->entries == NULL) sl->entries = malloc(sizeof(struct shift) * SPIKE_SHIFT_LOG);
+  struct shift *s = &sl->entries[sl->len++];
+  s->type = type;
+  s->at = at;
+  s->n = n;
+  s->moved = NULL;
+  if (type == CHANGE_PERMUTE) {
+    s->moved = malloc(sizeof(int) * n);
+    memcpy(s->moved, L.moved, sizeof(int) * n);
+  }
+}
+
+/* Brings an anchor up to date with the inserts and deletes made 
+ * since it was last looked at */
+void editorAnchorResolve(eanchor *a) {
+  struct shiftLog *sl = &E.shifts;
+  unsigned int end = sl->base + sl->len;
+  if (a->seen < sl->base) a->seen = sl->base;
+
+  for (; a->seen < end; a->seen++) {
+    struct shift *s = &sl->entries[a->seen - sl->base];
+    if (a->row < s->at) continue;
+    if (s->type == CHANGE_PERMUTE) {
+      if (a->row < s->at + s->n) a->row = s->at + s->moved[a->row - s->at];
+    } else if (s->type == CHANGE_INSERT) {
+      a->row += s->n;
+    } else if (a->row >= s->at + s->n) {
+      a->row -= s->n;
+    } else {
+
+      /* The row of the anchor was deleted */
+      a->row = s->at;
+      a->col = 0;
+    }
+  }
+}
+
+/* Returns an anchor at the cursor */
+eanchor editorAnchorHere() {
+  eanchor a;
+  a.row = E.cy;
+  a.col = E.cx;
+  a.seen = E.shifts.base + E.shifts.len;
+  return a;
+}
+
+/* Moves the cursor to an anchor */
+void editorAnchorGo(eanchor *a) {
+  editorAnchorResolve(a);
+  editorSetCursor(a->row, a->col);
+}
+
+/* Remembers the cursor position before a jump, dropping any 
+ * positions that could have been jumped forward to */
+void editorPushJump() {
+  if (E.numjumps > E.jumppos) E.numjumps = E.jumppos;
+  if (E.numjumps == SPIKE_JUMPS) {
+    memmove(&E.jumps[0], &E.jumps[1], sizeof(eanchor) * (SPIKE_JUMPS - 1));
+    E.numjumps--;
+  }
+  E.jumps[E.numjumps++] = editorAnchorHere();
+  E.jumppos = E.numjumps;
+}
+
+/* Goes back to where the cursor was before the last jump. The 
+ * position being left is remembered, to jump forward to again */
+void editorJumpBack() {
+  if (E.jumppos == 0) {
+    editorSetStatusMessage("No older position to jump back to");
+    return;
+  }
+  if (E.jumppos == E.numjumps) {
+    editorPushJump();
+    E.jumppos--;
+  }
+  E.jumppos--;
+  editorAnchorGo(&E.jumps[E.jumppos]);
+}
+
+/* Goes forward again to where a jump back came from */
+void editorJumpForward() {
+  if (E.jumppos + 1 >= E.numjumps) {
+    editorSetStatusMessage("No newer position to jump forward to");
+    return;
+  }
+  E.jumppos++;
+  editorAnchorGo(&E.jumps[E.jumppos]);
+}
+
+/* Returns the bookmark with the given name, or NULL */
+ebookmark *editorFindBookmark(const char *name) {
+  int j;
+  for (j = 0; j < E.numbookmarks; j++) {
+    if (strcmp(E.bookmarks[j].name, name) == 0) return &E.bookmarks[j];
+  }
+  return NULL;
+}
+
+/* Sets (or moves) a named bookmark at the cursor */
+void editorSetBookmark() {
+  char *name = editorPrompt("Set bookmark: %s (ESC to cancel)", NULL);
+  if (name == NULL) return;
+
+  ebookmark *b = editorFindBookmark(name);
+  if (b) {
+    free(name);
+  } else {
+    E.bookmarks = realloc(E.bookmarks, sizeof(ebookmark) * (E.numbookmarks + 1));
+    b = &E.bookmarks[E.numbookmarks++];
+    b->name = name;
+  }
+  b->anchor = editorAnchorHere();
+  editorSetStatusMessage("Bookmark %s set", b->name);
+}
+
+/* Jumps to a named bookmark */
+void editorGotoBookmark() {
+  char *name = editorPrompt("Go to bookmark: %s (ESC to cancel)", NULL);
+  if (name == NULL) return;
+
+  ebookmark *b = editorFindBookmark(name);
+  if (b) {
+    editorPushJump();
+    editorAnchorGo(&b->anchor);
+  } else {
+    editorSetStatusMessage("No bookmark named %s", name);
+  }
+  free(name);
+}
+
+/* Reads the key after the Ctrl-P prefix and runs the position 
+ * command it stands for */
+void editorPositionCommand() {
+  editorSetStatusMessage("Positions: s = set bookmark | g = go to bookmark | "
+			 "b = jump back | f = jump forward");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's': editorSetBookmark(); break;
+    case 'g': editorGotoBookmark(); break;
+    case 'b': editorJumpBack(); break;
+    case 'f': editorJumpForward(); break;
+  }
+}
+
+/* =============== Folds =============== */
+
+/* Regions of the file hidden behind their first line, found from
+ * indentation: the block under a row is every following row that 
+ * is blank or indented deeper than it. Drawing, scrolling and
+ * paging work in screen lines, which are mapped to rows through 
+ * the outermost folds, so hidden rows are skipped over in one step
+ * instead of being walked through */
+
+/* Returns the indent of a row in columns, or -1 for a blank row.
+ * It is worked out when first asked for after the row changed,
+ * which the generation of the row tells */
+int editorRowIndent(int at) {
+  erow *row = &E.row[at];
+  if (row->indentgen != row->gen) {
+    int end = editorSkipClass(row->chars, 0, row->size, CLASS_BLANK);
+    int j, col = 0;
+    for (j = 0; j < end; j++) {
+      if (row->chars[j] == '\t') col += SPIKE_TAB_STOP - (col % SPIKE_TAB_STOP);
+      else col++;
+    }
+    row->indent = end == row->size ? -1 : col;
+    row->indentgen = row->gen;
+  }
+  return row->indent;
+}
+
+/* Rebuilds the list of outermost folds, if the folds changed */
+void editorFoldIndex() {
+  struct foldSet *fs = &E.folds;
+  if (fs->valid) return;
+  fs->top = realloc(fs->top, sizeof(int) * (fs->num + 1));
+  fs->before = realloc(fs->before, sizeof(int) * (fs->num + 1));
+  fs->numtop = 0;
+  fs->hidden = 0;
+
+  int j, end = -1;
+  for (j = 0; j < fs->num; j++) {
+    if (fs->list[j].start <= end) continue;      /* Inside the last outermost fold */
+    fs->top[fs->numtop] = j;
+    fs->before[fs->numtop] = fs->hidden;
+    fs->numtop++;
+    fs->hidden += fs->list[j].end - fs->list[j].start;
+    end = fs->list[j].end;
+  }
+  fs->valid = 1;
+}
+
+/* Returns the index into top[] of the last outermost fold whose
+ * header is before a row, or -1 if there is none */
+int editorFoldBefore(int row) {
+  struct foldSet *fs = &E.folds;
+  int lo = 0, hi = fs->numtop;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fs->list[fs->top[mid]].start < row) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+/* Returns the screen line a row is drawn on, counted from the top
+ * of the file. A hidden row is on the line of its fold's header */
+int editorRowToVisual(int row) {
+  struct foldSet *fs = &E.folds;
+  if (fs->num == 0) return row;
+  editorFoldIndex();
+
+  int k = editorFoldBefore(row);
+  if (k < 0) return row;
+  efold *f = &fs->list[fs->top[k]];
+  if (row <= f->end) return f->start - fs->before[k];
+  return row - fs->before[k] - (f->end - f->start);
+}
+
+/* Returns the row drawn on a screen line, counted from the top of
+ * the file */
+int editorVisualToRow(int line) {
+  struct foldSet *fs = &E.folds;
+  if (fs->num == 0) return line;
+  editorFoldIndex();
+
+  /* The lines the headers are drawn on go up with k, so the last
+   * header above the line is found with a binary search */
+  int lo = 0, hi = fs->numtop;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fs->list[fs->top[mid]].start - fs->before[mid] < line) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return line;
+  efold *f = &fs->list[fs->top[lo - 1]];
+  return line + fs->before[lo - 1] + (f->end - f->start);
+}
+
+/* Returns the outermost fold that has its header on a row, or NULL.
+ * Used while drawing, where k carries on from the last call */
+efold *editorFoldAt(int row, int *k) {
+  struct foldSet *fs = &E.folds;
+  if (fs->num == 0) return NULL;
+  editorFoldIndex();
+
+  if (*k < 0) *k = editorFoldBefore(row) + 1;
+  while (*k < fs->numtop && fs->list[fs->top[*k]].start < row) (*k)++;
+  if (*k < fs->numtop && fs->list[fs->top[*k]].start == row) return &fs->list[fs->top[*k]];
+  return NULL;
+}
+
+/* Drops fold j from the list */
+void editorFoldRemove(int j) {
+  struct foldSet *fs = &E.folds;
+  editorDamageRows(fs->list[j].start, INT_MAX);
+  memmove(&fs->list[j], &fs->list[j + 1], sizeof(efold) * (fs->num - j - 1));
+  fs->num--;
+  fs->valid = 0;
+}
+
+/* Keeps the folds on their rows as rows are inserted, deleted and
+ * reordered. A fold whose rows were inserted into or deleted from
+ * is opened, as its block is no longer the one that was folded.
+ * The same goes for a fold that reordered rows were moved into or
+ * out of, while one that holds all of them stays closed */
+void editorFoldsChanged(int type, int at, int n) {
+  if (type == CHANGE_MODIFY) return;
+
+  struct foldSet *fs = &E.folds;
+  int j;
+  for (j = fs->num - 1; j >= 0; j--) {
+    efold *f = &fs->list[j];
+    if (type == CHANGE_PERMUTE) {
+      if (f->end < at || f->start >= at + n) continue;
+      if (f->start < at && f->end >= at + n - 1) continue;
+      editorFoldRemove(j);
+    } else if (type == CHANGE_INSERT) {
+      if (f->start >= at) {
+	f->start += n;
+	f->end += n;
+      } else if (f->end >= at) {
+	editorFoldRemove(j);
+      }
+    } else {
+      if (f->start >= at + n) {
+	f->start -= n;
+	f->end -= n;
+      } else if (f->end >= at) {
+	editorFoldRemove(j);
+      }
+    }
+  }
+  fs->valid = 0;
+}
+
+/* Opens the folds that hide a row, so that it can be shown */
+void editorFoldReveal(int row) {
+  struct foldSet *fs = &E.folds;
+  while (fs->num > 0) {
+    editorFoldIndex();
+    int k = editorFoldBefore(row);
+    if (k < 0 || fs->list[fs->top[k]].end < row) return;
+    editorFoldRemove(fs->top[k]);
+  }
+}
+
+/* Returns the last row of the block under a row, which is the row
+ * itself if nothing under it is indented deeper */
+int editorBlockEnd(int at) {
+  int indent = editorRowIndent(at);
+  int end = at, j;
+  if (indent < 0) return at;
+  for (j = at + 1; j < E.numrows; j++) {
+    int i = editorRowIndent(j);
+    if (i < 0) continue;
+    if (i <= indent) break;
+    end = j;
+  }
+  return end;
+}
+
+/* Adds a closed fold, replacing one with the same header and any
+ * that stick out of it */
+void editorFoldAdd(int start, int end) {
+  struct foldSet *fs = &E.folds;
+  int lo = 0, hi = fs->num;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fs->list[mid].start < start) lo = mid + 1;
+    else hi = mid;
+  }
+  while (lo < fs->num && fs->list[lo].start <= end && 
+	 (fs->list[lo].start == start || fs->list[lo].end > end)) {
+    editorFoldRemove(lo);
+  }
+
+  if (fs->num == fs->cap) {
+    fs->cap = fs->cap ? fs->cap * 2 : 16;
+    fs->list = realloc(fs->list, sizeof(efold) * fs->cap);
+  }
+  memmove(&fs->list[lo + 1], &fs->list[lo], sizeof(efold) * (fs->num - lo));
+  fs->list[lo].start = start;
+  fs->list[lo].end = end;
+  fs->num++;
+  fs->valid = 0;
+  editorDamageRows(start, INT_MAX);
+}
+
+/* Opens the fold on the cursor's row, or else closes the block the
+ * cursor is in. A row with nothing indented under it closes the 
+ * block of the nearest row above that is indented less */
+void editorFoldToggle() {
+  if (E.cy >= E.numrows) return;
+  struct foldSet *fs = &E.folds;
+  int k = -1;
+  efold *f = editorFoldAt(E.cy, &k);
+  if (f) {
+    editorFoldRemove(f - fs->list);
+    return;
+  }
+
+  int header = E.cy;
+  int end = editorBlockEnd(header);
+  if (end == header) {
+    int indent = editorRowIndent(header);
+    if (indent < 0) {
+      editorSetStatusMessage("Nothing to fold on a blank line");
+      return;
+    }
+    while (--header >= 0) {
+      int i = editorRowIndent(header);
+      if (i >= 0 && i < indent) break;
+    }
+    if (header < 0) {
+      editorSetStatusMessage("Nothing to fold here");
+      return;
+    }
+    end = editorBlockEnd(header);
+  }
+  editorFoldAdd(header, end);
+  E.cy = header;
+  E.cx = 0;
+}
+
+int editorFoldCompare(const void *a, const void *b) {
+  return ((const efold *)a)->start - ((const efold *)b)->start;
+}
+
+/* Closes the block under every row in one pass. The rows that 
+ * blocks start at are kept on a stack, and a row ends the blocks
+ * of the rows on the stack that are indented as deep or deeper */
+void editorFoldAll() {
+  struct foldSet *fs = &E.folds;
+  int *stack = malloc(sizeof(int) * (E.numrows + 1));
+  int depth = 0, last = -1, j;
+  fs->num = 0;
+
+  for (j = 0; j <= E.numrows; j++) {
+    int indent = j < E.numrows ? editorRowIndent(j) : -2;
+    if (indent == -1) continue;
+    while (depth > 0 && (indent == -2 || editorRowIndent(stack[depth - 1]) >= indent)) {
+      int start = stack[--depth];
+      if (last == start) continue;
+      if (fs->num == fs->cap) {
+	fs->cap = fs->cap ? fs->cap * 2 : 16;
+	fs->list = realloc(fs->list, sizeof(efold) * fs->cap);
+      }
+      fs->list[fs->num].start = start;
+      fs->list[fs->num].end = last;
+      fs->num++;
+    }
+    if (j < E.numrows) stack[depth++] = j;
+    last = j;
+  }
+  free(stack);
+
+  /* Inner blocks end first, so the folds are sorted afterwards */
+  qsort(fs->list, fs->num, sizeof(efold), editorFoldCompare);
+  fs->valid = 0;
+  editorDamageRows(0, INT_MAX);
+
+  /* Moves the cursor out of the folds, to the header it is under */
+  int cy = editorVisualToRow(editorRowToVisual(E.cy));
+  if (cy != E.cy) {
+    E.cy = cy;
+    E.cx = 0;
+  }
+  editorSetStatusMessage("%d folds closed", fs->num);
+}
+
+/* Opens every fold */
+void editorUnfoldAll() {
+  E.folds.num = 0;
+  E.folds.valid = 0;
+  editorDamageRows(0, INT_MAX);
+}
+
+/* Reads the key after the Ctrl-A prefix and runs the fold command
+ * it stands for */
+void editorFoldCommand() {
+  editorSetStatusMessage("Folds: f = toggle fold | c = close all | o = open all");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 'f': editorFoldToggle(); break;
+    case 'c': editorFoldAll(); break;
+    case 'o': editorUnfoldAll(); break;
+  }
+}
+
+/* =============== Undo =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_UNDO
+
+/* Returns the number of bytes a record with len bytes of data
+ * takes up in the undo log */
+size_t undoRecSize(size_t len) {
+  return sizeof(undoRec) + len + sizeof(size_t);
+}
+
+/* Makes sure that the undo log has room for extra more bytes */
+void undoReserve(size_t extra) {
+  if (E.undo.len + extra <= E.undo.cap) return;
+  size_t cap = E.undo.cap ? E.undo.cap * 2 : 4096;
+  while (cap < E.undo.len + extra) cap *= 2;
+  E.undo.buf = realloc(E.undo.buf, cap);
+  E.undo.cap = cap;
+}
+
+/* Returns the offset of the record that ends at end */
+size_t undoPrev(size_t end) {
+  size_t size;
+  memcpy(&size, &E.undo.buf[end - sizeof(size_t)], sizeof(size_t));
+  return end - size;
+}
+
+/* Copies the header of the record at off into rec */
+void undoReadRec(size_t off, undoRec *rec) {
+  memcpy(rec, &E.undo.buf[off], sizeof(undoRec));
+}
+
+/* Writes a record header and its trailing size at off. The data
+ * bytes in between are expected to be in place already */
+void undoWriteRec(size_t off, undoRec *rec) {
+  size_t size = undoRecSize(rec->len);
+  memcpy(&E.undo.buf[off], rec, sizeof(undoRec));
+  memcpy(&E.undo.buf[off + size - sizeof(size_t)], &size, sizeof(size_t));
+}
+
+/* Drops the references that the records between from and to
+ * hold on spans, before those records are thrown away */
+void undoReleaseSpans(size_t from, size_t to) {
+  undoRec rec;
+  while (from < to) {
+    undoReadRec(from, &rec);
+    if (rec.type == UNDO_INS_SPAN || rec.type == UNDO_DEL_SPAN ||
+	rec.type == UNDO_SWAP_SPAN) {
+      undoSpanRef ref;
+      memcpy(&ref, &E.undo.buf[from + sizeof(undoRec)], sizeof(ref));
+      E.undo.spanbytes -= ref.bytes;
+      spanRelease(ref.span);
+    }
+    from += undoRecSize(rec.len);
+  }
+}
+
+/* Throws away everything that could be redone */
+void undoDiscardRedo() {
+  undoReleaseSpans(E.undo.pos, E.undo.len);
+  E.undo.len = E.undo.pos;
+}
+
+/* Throws away the whole history */
+void editorUndoClear() {
+  undoReleaseSpans(0, E.undo.len);
+  free(E.undo.buf);
+  E.undo.buf = NULL;
+  E.undo.len = 0;
+  E.undo.cap = 0;
+  E.undo.pos = 0;
+}
+
+/* Starts a new undo group. Everything recorded until the next
+ * call is undone and redone as a single step */
+void editorUndoBoundary() {
+  E.undo.group++;
+  E.undo.cx = E.cx;
+  E.undo.cy = E.cy;
+}
+
+/* Drops the oldest groups until the log, and the rows it keeps 
+ * alive through spans, fit in 3/4 of SPIKE_UNDO_MAX again. The
+ * group being recorded is never dropped, so the latest change 
+ * can always be undone */
+void undoTrim() {
+  if (E.undo.len + E.undo.spanbytes <= SPIKE_UNDO_MAX) return;
+
+  size_t target = E.undo.len + E.undo.spanbytes - SPIKE_UNDO_MAX / 4 * 3;
+  size_t off = 0;
+  size_t cut = 0;
+  size_t freed = 0;
+  undoRec rec;
+
+  /* Only cuts at the start of a group */
+  while (off < E.undo.len) {
+    undoReadRec(off, &rec);
+    if (rec.group == E.undo.group) break;
+    freed += undoRecSize(rec.len);
+    if (rec.type == UNDO_INS_SPAN || rec.type == UNDO_DEL_SPAN ||
+	rec.type == UNDO_SWAP_SPAN) {
+      undoSpanRef ref;
+      memcpy(&ref, &E.undo.buf[off + sizeof(undoRec)], sizeof(ref));
+      freed += ref.bytes;
+    }
+    off += undoRecSize(rec.len);
+    if (off >= E.undo.len) break;
+    undoRec next;
+    undoReadRec(off, &next);
+    if (next.group != rec.group) {
+      cut = off;
+      if (freed >= target) break;
+    }
+  }
+  if (cut == 0) return;
+
+  undoReleaseSpans(0, cut);
+  memmove(E.undo.buf, &E.undo.buf[cut], E.undo.len - cut);
+  E.undo.len -= cut;
+  E.undo.pos -= cut;
+}
+
+/* Tries to merge a change into the last record, which is how
+ * a run of typed characters or deletions ends up as a single
+ * record. Returns 1 if the change was merged */
+int undoCoalesce(int type, int row, int col, const char *data, size_t len) {
+  if (E.undo.pos == 0) return 0;
+
+  size_t off = undoPrev(E.undo.pos);
+  undoRec rec;
+  undoReadRec(off, &rec);
+  if (rec.group != E.undo.group || rec.type != type || rec.row != row) return 0;
+
+  int prepend;
+  if (type == UNDO_INS_CHARS && rec.col + (int)rec.len == col) {
+    prepend = 0;
+  } else if (type == UNDO_DEL_CHARS && col == rec.col) {
+    prepend = 0;                  /* Deleting forwards (DEL key) */
+  } else if (type == UNDO_DEL_CHARS && col + (int)len == rec.col) {
+    prepend = 1;                  /* Deleting backwards (Backspace) */
+  } else {
+    return 0;
+  }
+
+  undoReserve(len);
+  char *d = &E.undo.buf[off + sizeof(undoRec)];
+  if (prepend) {
+    memmove(d + len, d, rec.len);
+    memcpy(d, data, len);
+    rec.col = col;
+  } else {
+    memcpy(d + rec.len, data, len);
+  }
+  rec.len += len;
+  undoWriteRec(off, &rec);
+  E.undo.len = E.undo.pos = off + undoRecSize(rec.len);
+  return 1;
+}
+
+/* Checks whether a change of len bytes should be recorded. A
+ * change too big for the log clears the history instead, and 
+ * the rest of its group is not recorded either, since undoing 
+ * only part of a command would leave the rows in a state that 
+ * never existed */
+int undoShouldRecord(size_t len) {
+  if (E.undo.suspended) return 0;
+  if (E.undo.dropped == E.undo.group) return 0;
+  if (undoRecSize(len) > SPIKE_UNDO_MAX) {
+    editorUndoClear();
+    E.undo.dropped = E.undo.group;
+    editorSetStatusMessage("Change too large to undo, history cleared");
+    return 0;
+  }
+  return 1;
+}
+
+/* Appends a record to the undo log. Anything that could be
+ * redone is thrown away, since it no longer applies */
+void editorUndoRecord(int type, int row, int col, int n, const char *data, size_t len) {
+  if (!undoShouldRecord(len)) return;
+  undoDiscardRedo();
+
+  /* Span records keep the span alive for as long as they exist */
+  if (type == UNDO_INS_SPAN || type == UNDO_DEL_SPAN || type == UNDO_SWAP_SPAN) {
+    undoSpanRef ref;
+    memcpy(&ref, data, sizeof(ref));
+    ref.span->refs++;
+    E.undo.spanbytes += ref.bytes;
+  }
+
+  if ((type == UNDO_INS_CHARS || type == UNDO_DEL_CHARS) &&
+      undoCoalesce(type, row, col, data, len)) return;
+
+  undoRec rec;
+  rec.type = type;
+  rec.group = E.undo.group;
+  rec.row = row;
+  rec.col = col;
+  rec.n = n;
+  rec.cx = E.undo.cx;
+  rec.cy = E.undo.cy;
+  rec.len = len;
+
+  undoReserve(undoRecSize(len));
+  if (len) memcpy(&E.undo.buf[E.undo.len + sizeof(undoRec)], data, len);
+  undoWriteRec(E.undo.len, &rec);
+  E.undo.len += undoRecSize(len);
+  E.undo.pos = E.undo.len;
+  undoTrim();
+}
+
+/* Records n whole rows starting at at. The rows are copied
+ * straight into the log, joined by '\n' */
+void editorUndoRecordRows(int type, int at, int n) {
+  if (E.undo.suspended) return;
+
+  size_t len = 0;
+  int j;
+  for (j = at; j < at + n; j++) len += E.row[j].size + 1;
+  if (len) len--;
+
+  if (!undoShouldRecord(len)) return;
+  undoDiscardRedo();
+
+  undoRec rec;
+  rec.type = type;
+  rec.group = E.undo.group;
+  rec.row = at;
+  rec.col = 0;
+  rec.n = n;
+  rec.cx = E.undo.cx;
+  rec.cy = E.undo.cy;
+  rec.len = len;
+
+  undoReserve(undoRecSize(len));
+  char *p = &E.undo.buf[E.undo.len + sizeof(undoRec)];
+  for (j = at; j < at + n; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    if (j < at + n - 1) *p++ = '\n';
+  }
+  undoWriteRec(E.undo.len, &rec);
+  E.undo.len += undoRecSize(len);
+  E.undo.pos = E.undo.len;
+  undoTrim();
 }
 
-/* Uses editorInsertRow(...) to either insert a new blank
- * row or split the current line into two rows, depending
- * on where the cursor is */
-void editorInsertNewline() {
+/* Applies a record to the rows, either as it was made (redo) or
+ * its inverse (undo). Every record is applied with one batched 
+ * row operation, however many bytes or rows it covers. The 
+ * cursor is left where the change happened */
+void undoApply(size_t off, int inverse) {
+  undoRec rec;
+  undoReadRec(off, &rec);
+  char *data = &E.undo.buf[off + sizeof(undoRec)];
+
+  int type = rec.type;
+  if (inverse) {
+    switch (type) {
+      case UNDO_INS_CHARS: type = UNDO_DEL_CHARS; break;
+      case UNDO_DEL_CHARS: type = UNDO_INS_CHARS; break;
+      case UNDO_INS_ROWS: type = UNDO_DEL_ROWS; break;
+      case UNDO_DEL_ROWS: type = UNDO_INS_ROWS; break;
+      case UNDO_SPLIT: type = UNDO_JOIN; break;
+      case UNDO_JOIN: type = UNDO_SPLIT; break;
+      case UNDO_INS_SPAN: type = UNDO_DEL_SPAN; break;
+      case UNDO_DEL_SPAN: type = UNDO_INS_SPAN; break;
+      case UNDO_INS_RECT: type = UNDO_DEL_RECT; break;
+      case UNDO_DEL_RECT: type = UNDO_INS_RECT; break;
+      case UNDO_PERMUTE: type = UNDO_UNPERMUTE; break;
+      case UNDO_UNPERMUTE: type = UNDO_PERMUTE; break;
+    }
+  }
 
-  /* If the cursor is at the beginning of a line, a new
-   * blank row will be inserted before the current line */
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
+  /* Rows that do not exist mean the log is out of sync with 
+   * the rows, which should not happen, but is not worth 
+   * crashing over */
+  if (rec.row < 0 || rec.row > E.numrows) return;
+  if (rec.row == E.numrows && type != UNDO_INS_ROWS && type != UNDO_INS_SPAN) return;
+
+  /* Rectangle records carry their own per-row columns */
+  if (type == UNDO_INS_RECT || type == UNDO_DEL_RECT) {
+    editorRectApply(rec.row, rec.n, data, rec.len, type == UNDO_INS_RECT);
+    E.cy = rec.row;
+    memcpy(&E.cx, data, sizeof(int));
+    return;
+  }
+  if (type == UNDO_PERMUTE || type == UNDO_UNPERMUTE) {
+    editorPermuteRows(rec.row, rec.n, (const int *)data, type == UNDO_UNPERMUTE);
+    E.cy = rec.row;
+    E.cx = 0;
+    return;
+  }
 
-    /* Puts all of the characters on the current row that
-     * are on the right side of the cursor onto a new row, 
-     * after the current one (split into 2 rows) */
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+  /* Swapping the chars back is its own inverse */
+  if (type == UNDO_SWAP_SPAN) {
+    undoSpanRef ref;
+    memcpy(&ref, data, sizeof(ref));
+    int *rows = malloc(sizeof(int) * rec.n);
+    memcpy(rows, data + sizeof(ref), sizeof(int) * rec.n);
+    editorSwapSpanRows(ref.span, rows, rec.n);
+    free(rows);
+    E.cy = rec.row;
+    E.cx = 0;
+    return;
+  }
+
+  undoSpanRef ref;
+  if (rec.type == UNDO_INS_SPAN || rec.type == UNDO_DEL_SPAN)
+    memcpy(&ref, data, sizeof(ref));
+
+  switch (type) {
+    case UNDO_INS_CHARS:
+      editorRowInsertChars(&E.row[rec.row], rec.col, data, rec.len);
+      E.cy = rec.row;
+      E.cx = rec.col + rec.len;
+      break;
+    case UNDO_DEL_CHARS:
+      editorRowDelChars(&E.row[rec.row], rec.col, rec.len);
+      E.cy = rec.row;
+      E.cx = rec.col;
+      break;
+    case UNDO_INS_ROWS:
+      editorInsertRowsFromText(rec.row, rec.n, data, rec.len);
+      E.cy = rec.row;
+      E.cx = 0;
+      break;
+    case UNDO_DEL_ROWS:
+      editorDelRows(rec.row, rec.n);
+      E.cy = rec.row;
+      E.cx = 0;
+      break;
+    case UNDO_SPLIT:
+      editorRowSplit(rec.row, rec.col);
+      E.cy = rec.row + 1;
+      E.cx = 0;
+      break;
+    case UNDO_JOIN:
+      editorRowJoin(rec.row);
+      E.cy = rec.row;
+      E.cx = rec.col;
+      break;
+    case UNDO_INS_SPAN:
+      editorInsertSpanRows(rec.row, ref.span, ref.first, rec.n);
+      E.cy = rec.row;
+      E.cx = 0;
+      break;
+    case UNDO_DEL_SPAN:
 
-    /* row is reassigned, due to calling realloc() in 
-     * editorInsertRow(...), which might invalidate the 
-     * pointer */
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+      /* The rows being deleted are sharing the span's chars, so 
+       * deleting them only drops their references */
+      editorDelRows(rec.row, rec.n);
+      E.cy = rec.row;
+      E.cx = 0;
+      break;
   }
-  E.cy++;
-  E.cx = 0;
 }
 
-/* Takes in a character and uses editorRowDelChar(...)
- * to delete the character that is to the left of the
- * cursor */
-void editorDelChar() {
-  if (E.cy == E.numrows) return;         /* At the end of a file */
-  if (E.cx == 0 && E.cy == 0) return;    /* At the beginning of a file */
+/* Undoes the last group of changes */
+void editorUndo() {
+  if (E.undo.pos == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
 
-  /* Sets row to the address of the erow the cursor
-   * is on */
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
+  undoRec rec;
+  size_t off = undoPrev(E.undo.pos);
+  undoReadRec(off, &rec);
+  unsigned int group = rec.group;
 
-    /* E.cx is set to the end of the line before the 
-     * current one */ 
-    E.cx = E.row[E.cy - 1].size;
+  /* Walks the group backwards, undoing the newest change first */
+  E.undo.suspended++;
+  while (1) {
+    undoApply(off, 1);
+    E.undo.pos = off;
+    if (off == 0) break;
+    off = undoPrev(off);
+    undoReadRec(off, &rec);
+    if (rec.group != group) break;
+  }
+  E.undo.suspended--;
 
-    /* Contents of current row are appended to the line
-     * before it */
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+  /* Puts the cursor back where it was before the command */
+  undoReadRec(E.undo.pos, &rec);
+  editorSetCursor(rec.cy, rec.cx);
+}
 
-    /* Current row gets deleted by overwriting it */
-    editorDelRow(E.cy);
-    E.cy--;
+/* Redoes the last group of changes that was undone */
+void editorRedo() {
+  if (E.undo.pos == E.undo.len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+
+  undoRec rec;
+  undoReadRec(E.undo.pos, &rec);
+  unsigned int group = rec.group;
+
+  E.undo.suspended++;
+  while (E.undo.pos < E.undo.len) {
+    undoReadRec(E.undo.pos, &rec);
+    if (rec.group != group) break;
+    undoApply(E.undo.pos, 0);
+    E.undo.pos += undoRecSize(rec.len);
   }
+  E.undo.suspended--;
+  editorSetCursor(E.cy, E.cx);
 }
 
 /* =============== File I/O =============== */
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_FILE
+
 /* Converts an array of erow structs into a single string,
  * which will be written out to a file */
 char *editorRowsToString(int *buflen) {
@@ -548,6 +4578,7 @@ char *editorRowsToString(int *buflen) {
 
 /* Allows the user to open a preexisting file */
 void editorOpen(char *filename) {
+  editorTraceBegin("open");
   free(E.filename);
 
   /* Makes a copy of the given string, or the file's name in
@@ -564,6 +4595,11 @@ void editorOpen(char *filename) {
   size_t linecap = 0;    /* Line capacity */    
   ssize_t linelen;       /* Signed version (can represent -1) */
 
+  /* Loading the file is not something that can be undone. Its 
+   * words are indexed in the background instead of row by row */
+  E.undo.suspended++;
+  E.words.suspended++;
+
   /* Passing in a null line pointer and a linecap of 0, so that
    * it allocates new memory for each line it reads. It sets line 
    * to point to the memory and linecap to the amount of memory it
@@ -577,7 +4613,12 @@ void editorOpen(char *filename) {
   }
   free(line);
   fclose(fp);
+  E.undo.suspended--;
+  E.words.suspended--;
+  editorUndoClear();
+  editorWordsStart(filename);
   E.dirty = 0;
+  editorTraceEnd("open");
 }
 
 /* Writes the string returned by editorRowsToString() to disk */
@@ -595,6 +4636,7 @@ void editorSave() {
     }
   }
 
+  editorTraceBegin("save");
   int len;
   char *buf = editorRowsToString(&len);
 
@@ -613,6 +4655,7 @@ void editorSave() {
 	free(buf);
 	E.dirty = 0;
 	editorSetStatusMessage("%d bytes written to disk", len);
+	editorTraceEnd("save");
 	return;
       }
     }
@@ -624,10 +4667,186 @@ void editorSave() {
   /* strerror() takes the errno value as an argument and 
    * returns the human-readable string for that error code */
   editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  editorTraceEnd("save");
+}
+
+/* =============== Buffers =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_BUFFERS
+
+/* Whether any open buffer has changes that were not saved */
+int editorUnsavedBuffers() {
+  if (E.dirty) return 1;
+  int j;
+  for (j = 0; j < B.numbufs; j++) {
+    if (j != B.current && B.bufs[j].dirty) return 1;
+  }
+  return 0;
+}
+
+/* Frees the render and hl arrays of every row of a buffer that is
+ * not being shown. They are built again as the rows get drawn */
+void editorDropCaches(struct editorConfig *buf) {
+  int j;
+  for (j = 0; j < buf->numrows; j++) {
+    erow *row = &buf->row[j];
+    if (row->render == NULL) continue;
+    buf->slack -= editorMallocSlack(row->rsize + 1) + editorMallocSlack(row->rsize);
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+  }
+  buf->renderbytes = 0;
+}
+
+/* Drops the caches of the buffers used longest ago until the 
+ * buffers that are not shown hold at most SPIKE_CACHE_MAX bytes */
+void editorTrimCaches() {
+  size_t total = 0;
+  int j;
+  for (j = 0; j < B.numbufs; j++) {
+    if (j != B.current) total += B.bufs[j].renderbytes;
+  }
+
+  while (total > SPIKE_CACHE_MAX) {
+    int oldest = -1;
+    for (j = 0; j < B.numbufs; j++) {
+      if (j == B.current || B.bufs[j].renderbytes == 0) continue;
+      if (oldest == -1 || B.bufs[j].lastused < B.bufs[oldest].lastused) oldest = j;
+    }
+    total -= B.bufs[oldest].renderbytes;
+    editorDropCaches(&B.bufs[oldest]);
+  }
+}
+
+/* Copies the state every buffer shares from E into buf, which is 
+ * about to become the current buffer */
+void editorShareState(struct editorConfig *buf) {
+  buf->screenrows = E.screenrows;
+  buf->screencols = E.screencols;
+  memcpy(buf->killring, E.killring, sizeof(E.killring));
+  buf->killlen = E.killlen;
+  buf->lastkill = 0;
+  buf->rectkill = E.rectkill;
+  buf->lastcomplete = 0;
+  buf->orig_termios = E.orig_termios;
+  memcpy(buf->statusmsg, E.statusmsg, sizeof(E.statusmsg));
+  buf->statusmsg_time = E.statusmsg_time;
+}
+
+/* Makes buffer to the current one. Only the struct of the buffer
+ * is copied, its rows and caches stay where they are */
+void editorSwitchBuffer(int to) {
+  if (to < 0 || to >= B.numbufs) {
+    editorSetStatusMessage("There are only %d buffers", B.numbufs);
+    return;
+  }
+  if (to == B.current) return;
+
+  E.lastused = ++B.clock;
+  B.bufs[B.current] = E;
+  editorShareState(&B.bufs[to]);
+  E = B.bufs[to];
+  B.current = to;
+
+  editorTrimCaches();
+  editorResetViews();
+  editorSetStatusMessage("Buffer %d of %d: %s", to + 1, B.numbufs,
+			 E.filename ? E.filename : "[No Name]");
+}
+
+/* Adds an empty buffer and makes it the current one */
+void editorNewBuffer() {
+  E.lastused = ++B.clock;
+  B.bufs = realloc(B.bufs, sizeof(struct editorConfig) * (B.numbufs + 1));
+  B.bufs[B.current] = E;
+  B.current = B.numbufs++;
+  initBuffer();
+}
+
+/* Adds a line of the memory report */
+int editorMemoryLine(char *buf, size_t size, int len, const char *name, size_t bytes,
+		     const char *note) {
+  if (len >= (int)size) return len;
+  return len + snprintf(&buf[len], size - len, "%-14s %14zu %10.1f MB  %s\n", name, bytes,
+			bytes / 1048576.0, note);
+}
+
+/* Writes what the rows and caches of the buffers take up into buf.
+ * Every number comes from counts that are kept up to date as the
+ * rows change, so no row is looked at. Shared chars belong to the
+ * spans of the kill ring and undo log, and can be counted there 
+ * as well */
+int editorMemoryReport(char *buf, size_t size) {
+  size_t rowarray = sizeof(erow) * E.numrows;
+  size_t lineindex = E.lineoff ? sizeof(size_t) * (E.numrows + 1) : 0;
+  size_t words = sizeof(wordNode) * E.words.cap;
+  size_t slack = E.slack + (E.numrows ? editorMallocSlack(rowarray) : 0);
+  size_t total = E.charbytes + E.sharedbytes + E.renderbytes + rowarray + lineindex +
+    words + E.undo.cap + E.undo.spanbytes + slack;
+
+  int len = snprintf(buf, size, "Buffer %d of %d, %d rows\n", B.current + 1, B.numbufs,
+		     E.numrows);
+  len = editorMemoryLine(buf, size, len, "chars", E.charbytes, "owned by the rows");
+  len = editorMemoryLine(buf, size, len, "shared chars", E.sharedbytes, "shared with spans");
+  len = editorMemoryLine(buf, size, len, "render", E.renderbytes / 2, "rows drawn or searched");
+  len = editorMemoryLine(buf, size, len, "hl", E.renderbytes / 2, "");
+  len = editorMemoryLine(buf, size, len, "row array", rowarray, "");
+  len = editorMemoryLine(buf, size, len, "line index", lineindex, "");
+  len = editorMemoryLine(buf, size, len, "word index", words, "");
+  len = editorMemoryLine(buf, size, len, "undo log", E.undo.cap, "");
+  len = editorMemoryLine(buf, size, len, "undo spans", E.undo.spanbytes, "deleted rows kept");
+  len = editorMemoryLine(buf, size, len, "malloc slack", slack, "estimated");
+  len = editorMemoryLine(buf, size, len, "total", total, "");
+
+  /* The caches of the other buffers are what editorTrimCaches() 
+   * drops when they grow past SPIKE_CACHE_MAX */
+  size_t others = 0, cache = 0, kills = 0;
+  int j;
+  for (j = 0; j < B.numbufs; j++) {
+    if (j == B.current) continue;
+    struct editorConfig *other = &B.bufs[j];
+    others += other->charbytes + other->sharedbytes + other->renderbytes + other->slack +
+      sizeof(erow) * other->numrows;
+    cache += other->renderbytes;
+  }
+  for (j = 0; j < E.killlen; j++) kills += E.killring[j]->bytes;
+
+  long long last, p50, p99;
+  editorProfileStats(STAGE_COUNT, &last, &p50, &p99);
+
+  long pages = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(fp);
+  }
+
+  if (len < (int)size) len += snprintf(&buf[len], size - len, "\nShared by every buffer\n");
+  len = editorMemoryLine(buf, size, len, "other buffers", others, "rows and render");
+  len = editorMemoryLine(buf, size, len, "render caches", cache, "of the other buffers");
+  len = editorMemoryLine(buf, size, len, "kill ring", kills, "");
+  len = editorMemoryLine(buf, size, len, "frame buffer", (size_t)last, "last frame");
+  if (pages > 0) {
+    len = editorMemoryLine(buf, size, len, "resident", (size_t)pages * sysconf(_SC_PAGESIZE),
+			   "whole process");
+  } else {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    len = editorMemoryLine(buf, size, len, "peak resident", (size_t)ru.ru_maxrss * 1024,
+			   "whole process");
+  }
+  return len < (int)size ? len : (int)size - 1;
 }
 
 /* =============== Find =============== */
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_FIND
+
 /* Callback function for editorPrompt(...) that searches
  * for the current query string */
 void editorFindCallback(char *query, int key) {
@@ -654,6 +4873,7 @@ void editorFindCallback(char *query, int key) {
    * current hl array of the saved line using memcpy() */
   if (saved_hl) {
     memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    editorDamageRows(saved_hl_line, saved_hl_line);
     free(saved_hl);
     saved_hl = NULL;
   }
@@ -700,6 +4920,7 @@ void editorFindCallback(char *query, int key) {
     /* Checks if query is a substring of the current row.
      * Returns NULL if there is no match, and returns a
      * pointer to the matching substring if there is a match */
+    editorRowRender(row);
     char *match = strstr(row->render, query);
 
     if (match) {
@@ -720,66 +4941,582 @@ void editorFindCallback(char *query, int key) {
       /* Copies the hl array of the current row into saved_hl */
       memcpy(saved_hl, row->hl, row->rsize);
 
-      /* Fills the hl array with the value of HL_MATCH according
-       * to the index of the match in the render array and 
-       * the length of the query */ 
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
-  }
+      /* Fills the hl array with the value of HL_MATCH according
+       * to the index of the match in the render array and 
+       * the length of the query */ 
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      editorDamageRows(current, current);
+      break;
+    }
+  }
+}
+
+/* Allows user to search a file by calling editorFindCallback() */
+void editorFind() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+  
+  /* Prompts user for search query */
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  
+  if (query) {
+
+    /* The search is remembered as a jump from where it started */
+    int found_cx = E.cx, found_cy = E.cy;
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    editorPushJump();
+    E.cx = found_cx;
+    E.cy = found_cy;
+    free(query);
+  } else {
+
+    /* Restores cursor position when search is cancelled */
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/* =============== Append Buffer =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_ABUF
+
+/* Creating a dynamic string type that only supports appending */
+struct abuf {
+  char *b;
+  int len;
+};
+
+/* Constructor for the abuf type */ 
+#define ABUF_INIT {NULL, 0}
+
+/* Appends a string to an abuf type (our dynamic string type) */
+void abAppend(struct abuf *ab, const char *s, int len) {
+
+  /* Allocates a block of memory that is the size of the current 
+   * string + the size of the new string being appended */
+  char *new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL) return;
+
+  /* Copies the new string, s, after the end of the current string */
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+/* Destructor that deallocates the dynamic memory used by an abuf type*/
+/* Appends n spaces, a block of them at a time rather than with 
+ * one abAppend() and so one realloc() per space */
+void abAppendSpaces(struct abuf *ab, int n) {
+  static const char spaces[] = "                                                                "
+			       "                                                                ";
+  while (n > 0) {
+    int len = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+    abAppend(ab, spaces, len);
+    n -= len;
+  }
+}
+
+void abFree(struct abuf *ab) {
+  free(ab->b);
+}
+
+/* =============== Rectangles =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_EDIT
+
+/* Gets the rectangle spanned by the mark and the cursor: rows r1
+ * to r2 and screen (render) columns x1 up to, not including, x2.
+ * Returns 0 if there is no rectangle */
+int editorGetRect(int *r1, int *r2, int *x1, int *x2) {
+  if (!E.markset || E.numrows == 0) return 0;
+
+  int my = E.marky < E.numrows ? E.marky : E.numrows - 1;
+  int cy = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  int mx = E.markx > E.row[my].size ? E.row[my].size : E.markx;
+  int mrx = editorRowCxToRx(&E.row[my], mx);
+  int crx = editorRowCxToRx(&E.row[cy], E.cx > E.row[cy].size ? E.row[cy].size : E.cx);
+
+  *r1 = my < cy ? my : cy;
+  *r2 = my < cy ? cy : my;
+  *x1 = mrx < crx ? mrx : crx;
+  *x2 = mrx < crx ? crx : mrx;
+  return 1;
+}
+
+/* A rectangle change spread over the thread pool. Every task 
+ * works out the new chars of a chunk of rows, leaving NULL for 
+ * rows that stay as they are */
+struct rectJob {
+  int at;
+  int chunk;
+  int insert;
+  const char **entries; /* Entry of each row in the blob */
+  char **chars;
+  int *sizes;
+  int n;
+};
+
+/* Builds the new chars of one chunk of rows of a rectangle change */
+void rectTask(void *arg, int task) {
+  struct rectJob *job = arg;
+  int lo = task * job->chunk;
+  int hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+  int j;
+  for (j = lo; j < hi; j++) {
+    erow *row = &E.row[job->at + j];
+    int col, cnt;
+    memcpy(&col, job->entries[j], sizeof(int));
+    memcpy(&cnt, job->entries[j] + sizeof(int), sizeof(int));
+    const char *bytes = job->entries[j] + 2 * sizeof(int);
+    job->chars[j] = NULL;
+    if (cnt <= 0) continue;
+
+    /* Columns out of range are treated as editorRowInsertChars()
+     * and editorRowDelChars() treat them */
+    char *chars;
+    if (job->insert) {
+      if (col < 0 || col > row->size) col = row->size;
+      job->sizes[j] = row->size + cnt;
+      chars = malloc(job->sizes[j] + 1);
+      memcpy(chars, row->chars, col);
+      memcpy(&chars[col], bytes, cnt);
+      memcpy(&chars[col + cnt], &row->chars[col], row->size - col);
+    } else {
+      if (col < 0 || col >= row->size) continue;
+      if (cnt > row->size - col) cnt = row->size - col;
+      job->sizes[j] = row->size - cnt;
+      chars = malloc(job->sizes[j] + 1);
+      memcpy(chars, row->chars, col);
+      memcpy(&chars[col], &row->chars[col + cnt], row->size - col - cnt);
+    }
+    chars[job->sizes[j]] = '\0';
+    job->chars[j] = chars;
+  }
+}
+
+/* Changes n rows starting at at by a rectangle blob, which holds
+ * for every row, one after another, an int column, an int length
+ * and that many bytes. The bytes are inserted at (insert = 1) or
+ * deleted from (insert = 0) the column of each row. No row depends
+ * on another, so the new rows are worked out in parallel, and then
+ * swapped in, in place, as a retab does. The whole blob is one 
+ * undo record */
+void editorRectApply(int at, int n, const char *data, size_t len, int insert) {
+  editorUndoRecord(insert ? UNDO_INS_RECT : UNDO_DEL_RECT, at, 0, n, data, len);
+  if (n > E.numrows - at) n = E.numrows - at;
+  if (n <= 0) return;
+
+  struct rectJob job;
+  job.at = at;
+  job.n = n;
+  job.insert = insert;
+  job.entries = malloc(sizeof(char *) * n);
+  job.chars = malloc(sizeof(char *) * n);
+  job.sizes = malloc(sizeof(int) * n);
+  const char *p = data;
+  int j;
+  for (j = 0; j < n; j++) {
+    int cnt;
+    memcpy(&cnt, p + sizeof(int), sizeof(int));
+    job.entries[j] = p;
+    p += 2 * sizeof(int) + cnt;
+  }
+
+  int chunks = poolThreads() * 4;
+  job.chunk = (n + chunks - 1) / chunks;
+  if (job.chunk < 4096) job.chunk = 4096;
+  chunks = (n + job.chunk - 1) / job.chunk;
+  poolRun(rectTask, &job, chunks);
+
+  int changed = 0;
+  for (j = 0; j < n; j++) {
+    if (job.chars[j]) changed++;
+  }
+  espan *span = spanNew(changed);
+  int *rows = malloc(sizeof(int) * (changed ? changed : 1));
+  int k = 0;
+  for (j = 0; j < n; j++) {
+    if (job.chars[j] == NULL) continue;
+    span->rows[k].size = job.sizes[j];
+    span->rows[k].chars = job.chars[j];
+    span->bytes += job.sizes[j];
+    rows[k++] = at + j;
+  }
+
+  /* The blob is the undo record, the old chars are let go */
+  E.undo.suspended++;
+  editorSwapSpanRows(span, rows, changed);
+  E.undo.suspended--;
+  spanRelease(span);
+  free(rows);
+  free(job.entries);
+  free(job.chars);
+  free(job.sizes);
+}
+
+/* Appends one row's entry to a rectangle blob being built */
+void rectBlobAppend(struct abuf *blob, int col, const char *s, int len) {
+  abAppend(blob, (char *)&col, sizeof(int));
+  abAppend(blob, (char *)&len, sizeof(int));
+  abAppend(blob, s, len);
+}
+
+/* Deletes the rectangle. With kill set, its contents are kept, 
+ * one row per line, to be yanked back with editorRectYank() */
+void editorRectDelete(int kill) {
+  int r1, r2, x1, x2;
+  if (!editorGetRect(&r1, &r2, &x1, &x2)) {
+    editorSetStatusMessage("No rectangle selected (Ctrl-Space sets the mark)");
+    return;
+  }
+
+  int n = r2 - r1 + 1;
+  espan *span = kill ? spanNew(n) : NULL;
+  struct abuf blob = ABUF_INIT;
+  int j;
+  for (j = 0; j < n; j++) {
+    erow *row = &E.row[r1 + j];
+    int c1 = editorRowRxToCx(row, x1);
+    int c2 = editorRowRxToCx(row, x2);
+    rectBlobAppend(&blob, c1, &row->chars[c1], c2 - c1);
+    if (span) {
+      span->rows[j].size = c2 - c1;
+      span->rows[j].chars = malloc(c2 - c1 + 1);
+      memcpy(span->rows[j].chars, &row->chars[c1], c2 - c1);
+      span->rows[j].chars[c2 - c1] = '\0';
+      span->bytes += c2 - c1;
+    }
+  }
+  editorRectApply(r1, n, blob.b, blob.len, 0);
+  abFree(&blob);
+
+  if (span) {
+    spanRelease(E.rectkill);
+    E.rectkill = span;
+  }
+  E.markset = 0;
+  E.rectmode = 0;
+  editorSetCursor(r1, editorRowRxToCx(&E.row[r1], x1));
+}
+
+/* Inserts one string per row, for n rows starting at at, at screen
+ * column x. Rows too short to reach x are padded with spaces, and
+ * missing rows at the end of the file are added */
+void editorRectInsert(int at, int n, int x, const char **strs, const int *lens) {
+  if (at + n > E.numrows) editorInsertBlankRows(E.numrows, at + n - E.numrows);
+
+  struct abuf blob = ABUF_INIT;
+  char *pad = NULL;
+  int j;
+  for (j = 0; j < n; j++) {
+    erow *row = &E.row[at + j];
+    int col = editorRowRxToCx(row, x);
+    int width = col == row->size ? x - editorRowCxToRx(row, col) : 0;
+    if (width > 0) {
+      pad = realloc(pad, width + lens[j]);
+      memset(pad, ' ', width);
+      memcpy(&pad[width], strs[j], lens[j]);
+      rectBlobAppend(&blob, col, pad, width + lens[j]);
+    } else {
+      rectBlobAppend(&blob, col, strs[j], lens[j]);
+    }
+  }
+  free(pad);
+  editorRectApply(at, n, blob.b, blob.len, 1);
+  abFree(&blob);
+}
+
+/* Inserts the last killed rectangle with its top left corner at 
+ * the cursor */
+void editorRectYank() {
+  if (E.rectkill == NULL) {
+    editorSetStatusMessage("No rectangle to yank");
+    return;
+  }
+  int n = E.rectkill->numrows;
+  const char **strs = malloc(sizeof(char *) * n);
+  int *lens = malloc(sizeof(int) * n);
+  int j;
+  for (j = 0; j < n; j++) {
+    strs[j] = E.rectkill->rows[j].chars;
+    lens[j] = E.rectkill->rows[j].size;
+  }
+  int x = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+  editorRectInsert(E.cy, n, x, strs, lens);
+  free(strs);
+  free(lens);
+}
+
+/* Inserts the same string on every row of the rectangle, at its 
+ * left edge. With open set, the string is the width of the 
+ * rectangle in spaces, which shifts the rectangle right */
+void editorRectString(int open) {
+  int r1, r2, x1, x2;
+  if (!editorGetRect(&r1, &r2, &x1, &x2)) {
+    editorSetStatusMessage("No rectangle selected (Ctrl-Space sets the mark)");
+    return;
+  }
+
+  char *s;
+  if (open) {
+    s = malloc(x2 - x1 + 1);
+    memset(s, ' ', x2 - x1);
+    s[x2 - x1] = '\0';
+  } else {
+    s = editorPrompt("String rectangle: %s (ESC to cancel)", NULL);
+    if (s == NULL) return;
+  }
+
+  int n = r2 - r1 + 1;
+  int len = strlen(s);
+  const char **strs = malloc(sizeof(char *) * n);
+  int *lens = malloc(sizeof(int) * n);
+  int j;
+  for (j = 0; j < n; j++) {
+    strs[j] = s;
+    lens[j] = len;
+  }
+  editorRectInsert(r1, n, x1, strs, lens);
+  free(strs);
+  free(lens);
+  free(s);
+  E.markset = 0;
+  E.rectmode = 0;
+}
+
+/* Reads the key after the Ctrl-X prefix and runs the rectangle 
+ * command it stands for */
+void editorRectCommand() {
+  editorSetStatusMessage("Rectangle: SPC = select | d = delete | k = kill | "
+			 "y = yank | t = string | o = open");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case ' ':
+    case CTRL_KEY(' '):
+      E.rectmode = !E.rectmode;
+      if (E.rectmode && !E.markset) {
+	E.markset = 1;
+	E.markx = E.cx;
+	E.marky = E.cy;
+      }
+      break;
+    case 'd': editorRectDelete(0); break;
+    case 'k': editorRectDelete(1); break;
+    case 'y': editorRectYank(); break;
+    case 't': editorRectString(0); break;
+    case 'o': editorRectString(1); break;
+  }
+}
+
+/* =============== Views =============== */
+
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_SCREEN
+
+/* Marks rows from to to (inclusive) as changed in every view, so
+ * that the lines showing them are drawn again. Rows that move up 
+ * or down are passed with to = INT_MAX */
+void editorDamageRows(int from, int to) {
+  int j;
+  for (j = 0; j < V.numviews; j++) {
+    eview *v = &V.views[j];
+    if (from < v->damagefrom) v->damagefrom = from;
+    if (to > v->damageto) v->damageto = to;
+  }
+}
+
+/* Marks the rows that a change touched as damaged. Inserts and
+ * deletes move every row after them */
+void editorViewsChanged(int type, int at, int n) {
+  if (type == CHANGE_MODIFY || type == CHANGE_PERMUTE) editorDamageRows(at, at + n - 1);
+  else editorDamageRows(at, INT_MAX);
+}
+
+/* Makes every view draw all of its lines on the next refresh */
+void editorDamageAll() {
+  int j;
+  for (j = 0; j < V.numviews; j++) V.views[j].drawnrow = -1;
+}
+
+/* Stores the cursor and viewport of the current view, which are
+ * kept in E while it is current */
+void editorSaveView() {
+  eview *v = &V.views[V.current];
+  v->cx = E.cx;
+  v->cy = E.cy;
+  v->rx = E.rx;
+  v->rowoff = E.rowoff;
+  v->coloff = E.coloff;
+}
+
+/* Makes view i the current one. The rows of the buffer may have 
+ * changed since it was current, so its cursor is kept in range */
+void editorLoadView(int i) {
+  V.current = i;
+  eview *v = &V.views[i];
+  E.cy = v->cy > E.numrows ? E.numrows : v->cy;
+  E.cx = v->cx;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  if (E.cy == E.numrows) E.cx = 0;
+  E.rx = v->rx;
+  E.rowoff = v->rowoff;
+  E.coloff = v->coloff;
+  E.screenrows = v->rows;
+  E.screencols = v->cols;
+}
+
+/* Sets the views up as a single one covering the whole screen */
+void editorInitViews(int termrows, int termcols) {
+  V.termrows = termrows;
+  V.termcols = termcols;
+  V.views = calloc(1, sizeof(eview));
+  V.numviews = 1;
+  V.current = 0;
+
+  /* The status line and the message bar take the last two lines */
+  eview *v = &V.views[0];
+  v->rows = termrows - 2;
+  v->cols = termcols;
+  v->drawnrow = -1;
+  v->damagefrom = INT_MAX;
+  v->damageto = -1;
 }
 
-/* Allows user to search a file by calling editorFindCallback() */
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
-  
-  /* Prompts user for search query */
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-  
-  if (query) {
-    free(query);
+/* Splits the current view in two, one above the other or, with 
+ * sidebyside set, next to each other. The new view shows the 
+ * same part of the buffer and becomes the current one */
+void editorSplitView(int sidebyside) {
+  editorSaveView();
+  eview *v = &V.views[V.current];
+  if (sidebyside ? v->cols < 20 : v->rows < 3) {
+    editorSetStatusMessage("The view is too small to split");
+    return;
+  }
+
+  V.views = realloc(V.views, sizeof(eview) * (V.numviews + 1));
+  v = &V.views[V.current];
+  memmove(&V.views[V.current + 2], &V.views[V.current + 1],
+	  sizeof(eview) * (V.numviews - V.current - 1));
+  V.numviews++;
+
+  eview *n = &V.views[V.current + 1];
+  *n = *v;
+  if (sidebyside) {
+
+    /* One column is left between them for a separator */
+    int total = v->cols;
+    v->cols = (total - 1) / 2;
+    n->left = v->left + v->cols + 1;
+    n->cols = total - v->cols - 1;
   } else {
 
-    /* Restores cursor position when search is cancelled */
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    /* Each view keeps a status line of its own */
+    int total = v->rows + 1;
+    v->rows = total / 2 - 1;
+    n->top = v->top + v->rows + 1;
+    n->rows = total - total / 2 - 1;
   }
+  editorDamageAll();
+  editorLoadView(V.current + 1);
+  editorScroll();
 }
 
-/* =============== Append Buffer =============== */
-
-/* Creating a dynamic string type that only supports appending */
-struct abuf {
-  char *b;
-  int len;
-};
-
-/* Constructor for the abuf type */ 
-#define ABUF_INIT {NULL, 0}
+/* Closes the current view and gives its space to a view next to 
+ * it that has the same height (or width), so that the views still
+ * tile the screen */
+void editorCloseView() {
+  if (V.numviews == 1) return;
+  eview *v = &V.views[V.current];
+  int j;
+  for (j = 0; j < V.numviews; j++) {
+    eview *o = &V.views[j];
+    if (j == V.current) continue;
+    if (o->top == v->top && o->rows == v->rows &&
+	(o->left + o->cols + 1 == v->left || v->left + v->cols + 1 == o->left)) {
+      if (v->left < o->left) o->left = v->left;
+      o->cols += v->cols + 1;
+      break;
+    }
+    if (o->left == v->left && o->cols == v->cols &&
+	(o->top + o->rows + 1 == v->top || v->top + v->rows + 1 == o->top)) {
+      if (v->top < o->top) o->top = v->top;
+      o->rows += v->rows + 1;
+      break;
+    }
+  }
+  if (j == V.numviews) {
+    editorSetStatusMessage("No view next to this one can take its place");
+    return;
+  }
 
-/* Appends a string to an abuf type (our dynamic string type) */
-void abAppend(struct abuf *ab, const char *s, int len) {
+  memmove(&V.views[V.current], &V.views[V.current + 1],
+	  sizeof(eview) * (V.numviews - V.current - 1));
+  V.numviews--;
+  if (j > V.current) j--;
+  editorDamageAll();
+  editorLoadView(j);
+  editorScroll();
+}
 
-  /* Allocates a block of memory that is the size of the current 
-   * string + the size of the new string being appended */
-  char *new = realloc(ab->b, ab->len + len);
+/* Closes every view but the current one, which gets the screen */
+void editorOnlyView() {
+  editorSaveView();
+  V.views[0] = V.views[V.current];
+  V.numviews = 1;
+  eview *v = &V.views[0];
+  v->top = 0;
+  v->left = 0;
+  v->rows = V.termrows - 2;
+  v->cols = V.termcols;
+  editorDamageAll();
+  editorLoadView(0);
+}
 
-  if (new == NULL) return;
+/* Moves to the next view */
+void editorNextView() {
+  editorSaveView();
+  editorLoadView((V.current + 1) % V.numviews);
+}
 
-  /* Copies the new string, s, after the end of the current string */
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+/* Puts the views that are not current back at the top, after the
+ * buffer they were showing has been swapped out */
+void editorResetViews() {
+  int j;
+  for (j = 0; j < V.numviews; j++) {
+    if (j == V.current) continue;
+    V.views[j].cx = V.views[j].cy = V.views[j].rx = 0;
+    V.views[j].rowoff = V.views[j].coloff = 0;
+  }
+  editorDamageAll();
 }
 
-/* Destructor that deallocates the dynamic memory used by an abuf type*/
-void abFree(struct abuf *ab) {
-  free(ab->b);
+/* Reads the key after the Ctrl-V prefix and runs the view command 
+ * it stands for */
+void editorViewCommand() {
+  editorSetStatusMessage("View: s = split | v = split side by side | n = next | "
+			 "c = close | o = only this one");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's': editorSplitView(0); break;
+    case 'v': editorSplitView(1); break;
+    case 'n': editorNextView(); break;
+    case 'c': editorCloseView(); break;
+    case 'o': editorOnlyView(); break;
+  }
 }
 
 /* =============== Output =============== */
@@ -791,16 +5528,27 @@ void editorScroll() {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
   
+  /* The cursor is never left on a hidden row. The rows are compared
+   * by the screen lines they are on, which skips over folds */
+  editorFoldReveal(E.cy);
+  int vcy = editorRowToVisual(E.cy);
+  int vrowoff = editorRowToVisual(E.rowoff);
+
   /* Checks if the cursor is above the visible window. If so, scrolls
    * up to where the cursor is */
-  if (E.cy < E.rowoff) {
+  if (vcy < vrowoff) {
     E.rowoff = E.cy;
   }
 
   /* Checks if the cursor is below the visible window. If so, scrolls
    * down to where the cursor is */
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+  else if (vcy >= vrowoff + E.screenrows) {
+    E.rowoff = editorVisualToRow(vcy - E.screenrows + 1);
+  }
+
+  /* Moves a row offset that got folded away up to its header */
+  else {
+    E.rowoff = editorVisualToRow(vrowoff);
   }
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
@@ -811,15 +5559,54 @@ void editorScroll() {
 }
 
 /* Writes out to the user's file and/or displays the content
- * of the file */
-void editorDrawRows(struct abuf *ab) {
+ * of the file, in the lines of a view. Only lines whose rows have
+ * changed are drawn, unless the view has scrolled or has the 
+ * region or extra cursors (decorate) to show */
+void editorDrawRows(struct abuf *ab, eview *v, int decorate) {
+  decorate = decorate && (E.markset || E.numcursors > 0);
+  int all = v->drawnrow != v->rowoff || v->drawncol != v->coloff ||
+	    decorate || v->decorated;
+
+  /* Lines of views that do not reach the right edge of the 
+   * screen are blanked with spaces, as erasing to the end of
+   * the line would erase the view next to it. Such views draw a
+   * separator to their right when they are drawn in full */
+  int edge = v->left + v->cols >= V.termcols;
   int y;
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+  if (all && !edge) {
+    for (y = 0; y <= v->rows; y++) {
+      char sep[32];
+      int slen = snprintf(sep, sizeof(sep), "\x1b[%d;%dH|", v->top + y + 1,
+			  v->left + v->cols + 1);
+      abAppend(ab, sep, slen);
+    }
+  }
+
+
+  /* Rows are found by stepping over the folds from the first row
+   * on screen, rather than by counting hidden rows */
+  int filerow = editorVisualToRow(editorRowToVisual(v->rowoff));
+  int nextfold = -1;
+  for (y = 0; y < v->rows; y++, filerow++) {
+    efold *fold = filerow < E.numrows ? editorFoldAt(filerow, &nextfold) : NULL;
+    int skip = fold ? fold->end - fold->start : 0;
+    if (!all && (filerow < v->damagefrom || filerow > v->damageto)) {
+      filerow += skip;
+      continue;
+    }
+
+    char buf[32];
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + y + 1, v->left + 1);
+    abAppend(ab, buf, blen);
+    if (!edge) {
+      abAppendSpaces(ab, v->cols);
+      abAppend(ab, buf, blen);
+    }
+
     if (filerow >= E.numrows) {
       
       /* Displays a welcome message */
-      if (E.numrows == 0 && y == E.screenrows / 3) {
+      if (E.numrows == 0 && y == v->rows / 3) {
 	char welcome[80];
 	int welcomelen = snprintf(welcome, sizeof(welcome),
 				  "Spike editor -- version %s",
@@ -827,12 +5614,12 @@ void editorDrawRows(struct abuf *ab) {
 
 	/* Truncates the length of the string to make sure it fits 
 	 * in the terminal */
-	if (welcomelen > E.screencols) welcomelen = E.screencols;
+	if (welcomelen > v->cols) welcomelen = v->cols;
 
 	/* Centers the welcome message by dividing the screen's width
 	 * by 2, and then subtracting half of the message's length
 	 * from that */
-	int padding = (E.screencols - welcomelen) / 2;
+	int padding = (v->cols - welcomelen) / 2;
 	if (padding) {
 	  abAppend(ab, "-_-", 3);
 	  padding--;
@@ -843,21 +5630,58 @@ void editorDrawRows(struct abuf *ab) {
 	abAppend(ab, "-_-", 3);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      editorRowRender(&E.row[filerow]);
+      int len = E.row[filerow].rsize - v->coloff;
       if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
+      if (len > v->cols) len = v->cols;
 
       /* Now rendering/printing character-by-character */
-      char *c = &E.row[filerow].render[E.coloff];
+      char *c = &E.row[filerow].render[v->coloff];
 
       /* Pointer to the char in the hl array that 
        * corresponds to c */
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      unsigned char *hl = &E.row[filerow].hl[v->coloff];
+
+      /* Columns of this row that are in the region, which get 
+       * drawn in inverted colors */
+      int selstart = 0, selend = 0, selected = 0;
+      int r1, c1, r2, c2;
+      if (!decorate) {
+      } else if (E.rectmode) {
+	if (editorGetRect(&r1, &r2, &c1, &c2) && filerow >= r1 && filerow <= r2) {
+	  selstart = c1 - v->coloff;
+	  selend = c2 - v->coloff;
+	}
+      } else if (editorGetRegion(&r1, &c1, &r2, &c2) && filerow >= r1 && filerow <= r2) {
+	selstart = filerow == r1 ? editorRowCxToRx(&E.row[filerow], c1) : 0;
+	selend = filerow == r2 ? editorRowCxToRx(&E.row[filerow], c2)
+			       : E.row[filerow].rsize;
+	selstart -= v->coloff;
+	selend -= v->coloff;
+      }
+
+      /* Screen column of the next extra cursor on this row, drawn
+       * as an inverted character */
+      int nextcur = decorate ? editorFirstCursorOnRow(filerow) : E.numcursors;
+      int curcol = -1;
+      if (nextcur < E.numcursors && E.cursors[nextcur].cy == filerow)
+	curcol = editorRowCxToRx(&E.row[filerow], E.cursors[nextcur].cx) - v->coloff;
 
       /* -1 refers to the default text color */
       int current_color = -1;
       int j;
       for (j = 0; j < len; j++) {
+	if ((j >= selstart && j < selend) != selected) {
+	  selected = !selected;
+	  abAppend(ab, selected ? "\x1b[7m" : "\x1b[27m", selected ? 4 : 5);
+	}
+	while (curcol >= 0 && curcol < j) {
+	  nextcur++;
+	  curcol = -1;
+	  if (nextcur < E.numcursors && E.cursors[nextcur].cy == filerow)
+	    curcol = editorRowCxToRx(&E.row[filerow], E.cursors[nextcur].cx) - v->coloff;
+	}
+	if (j == curcol && !selected) abAppend(ab, "\x1b[7m", 4);
 	if (hl[j] == HL_NORMAL) {
 	  if (current_color != -1) {
 	    abAppend(ab, "\x1b[39m", 5);    /* text color = default */
@@ -879,27 +5703,68 @@ void editorDrawRows(struct abuf *ab) {
 	  }
 	  abAppend(ab, &c[j], 1);
 	}
+	if (j == curcol && !selected) abAppend(ab, "\x1b[27m", 5);
+      }
+      if (selected) abAppend(ab, "\x1b[27m", 5);
+
+      /* Draws a cursor that is past the end of the line */
+      while (curcol >= 0 && curcol < len) {
+	nextcur++;
+	curcol = -1;
+	if (nextcur < E.numcursors && E.cursors[nextcur].cy == filerow)
+	  curcol = editorRowCxToRx(&E.row[filerow], E.cursors[nextcur].cx) - v->coloff;
+      }
+      if (curcol == len && len < v->cols) {
+	abAppend(ab, "\x1b[7m \x1b[27m", 10);
+	len++;
       }
       abAppend(ab, "\x1b[39m", 5);
+
+      /* Tells how many rows a folded header hides */
+      if (fold) {
+	char more[32];
+	int mlen = snprintf(more, sizeof(more), " [+%d]", skip);
+	if (mlen > v->cols - len) mlen = v->cols - len;
+	if (mlen > 0) {
+	  abAppend(ab, "\x1b[36m", 5);
+	  abAppend(ab, more, mlen);
+	  abAppend(ab, "\x1b[39m", 5);
+	}
+	filerow += skip;
+      }
     }
     
-    abAppend(ab, "\x1b[K", 3);    /* Erases part of the current line */
-    abAppend(ab, "\r\n", 2);
+    if (edge) abAppend(ab, "\x1b[K", 3);    /* Erases part of the current line */
   }
+
+  v->drawnrow = v->rowoff;
+  v->drawncol = v->coloff;
+  v->decorated = decorate;
+  v->damagefrom = INT_MAX;
+  v->damageto = -1;
 }
 
 /* Creates a status bar at the bottom of the program */
-void editorDrawStatusBar(struct abuf *ab) {
+void editorDrawStatusBar(struct abuf *ab, eview *v) {
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + v->rows + 1, v->left + 1);
+  abAppend(ab, pos, plen);
   abAppend(ab, "\x1b[7m", 4);    /* Switches to inverted colors */
-  char status[80], rstatus[80];
+  char status[160], rstatus[80];
 
   /* Displays up to 20 characters of the filename and the
    * number of lines in the file */
-  int len = snprintf(status, sizeof(status), "%.20s --- %d lines %s",
-		     E.filename ? E.filename : "[No Name]", E.numrows,
-		     E.dirty ? "(modified)" : "");
+  int len = 0;
+  if (B.numbufs > 1)
+    len = snprintf(status, sizeof(status), "[%d/%d] ", B.current + 1, B.numbufs);
+  len += snprintf(&status[len], sizeof(status) - len, "%.20s --- %d lines %s",
+		  E.filename ? E.filename : "[No Name]", E.numrows,
+		  E.dirty ? "(modified)" : "");
+
+  /* The profiling HUD takes the place of the file name */
+  if (T.show && v == &V.views[V.current]) len = editorProfileHud(status, sizeof(status));
 
-  int curline = E.cy + 1;    /* current line */
+  int curline = v->cy + 1;    /* current line */
   int curpercent;
   int rlen;
   
@@ -907,7 +5772,7 @@ void editorDrawStatusBar(struct abuf *ab) {
    * number of rows in the editor is greater than the height
    * of the screen. Otherwise, only the current line number
    * is displayed */
-  if (E.numrows > E.screenrows ) {
+  if (E.numrows > v->rows ) {
     curpercent = (curline * 100) / E.numrows;
     if (curpercent > 100) curpercent = 100;
     rlen = snprintf(rstatus, sizeof(rstatus), "L%d | %d%%",
@@ -915,13 +5780,13 @@ void editorDrawStatusBar(struct abuf *ab) {
   } else {
     rlen = snprintf(rstatus, sizeof(rstatus), "L%d", curline);
   }
-  if (len > E.screencols) len = E.screencols;
+  if (len > v->cols) len = v->cols;
   abAppend(ab, status, len);
 
   /* Ensures that the second status string is only printed if it
    * were to reach the right edge of the screen when printed */
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
+  while (len < v->cols) {
+    if (v->cols - len == rlen) {
       abAppend(ab, rstatus, rlen);
       break;
     } else {
@@ -930,17 +5795,19 @@ void editorDrawStatusBar(struct abuf *ab) {
     }
   }
   abAppend(ab, "\x1b[m", 3);     /* Switches back to regular formatting */
-  abAppend(ab, "\r\n", 2);       /* Prints a new line after the status bar */
 }
 
 /* Creates a message bar at the very bottom of the program */
 void editorDrawMessageBar(struct abuf *ab) {
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", V.termrows);
+  abAppend(ab, pos, plen);
   abAppend(ab, "\x1b[K", 3);           /* Clears the message bar */
   int msglen = strlen(E.statusmsg);
 
   /* Shortens the statusmsg if it is longer than the width 
    * of the screen */
-  if (msglen > E.screencols) msglen = E.screencols;
+  if (msglen > V.termcols) msglen = V.termcols;
 
   /* If there is a message and it is less than 5 seconds
    * old, display the message */
@@ -948,29 +5815,79 @@ void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, E.statusmsg, msglen);
 }
 
+/* Shows a page of text over the whole screen until a key is 
+ * pressed, and then has every view drawn again */
+void editorShowText(const char *title, const char *text) {
+  struct abuf ab = ABUF_INIT;
+  abAppend(&ab, "\x1b[?25l\x1b[2J\x1b[H\x1b[7m", 14);
+  abAppend(&ab, title, strlen(title) < (size_t)V.termcols ? strlen(title) : (size_t)V.termcols);
+  abAppend(&ab, "\x1b[m", 3);
+
+  int y = 1;
+  while (*text && y < V.termrows - 1) {
+    const char *end = strchr(text, '\n');
+    size_t len = end ? (size_t)(end - text) : strlen(text);
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", ++y);
+    abAppend(&ab, pos, plen);
+    abAppend(&ab, text, len < (size_t)V.termcols ? len : (size_t)V.termcols);
+    text += end ? len + 1 : len;
+  }
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", V.termrows);
+  abAppend(&ab, pos, plen);
+  abAppend(&ab, "Press any key to go back", 24);
+  editorWrite(ab.b, ab.len);
+  abFree(&ab);
+
+  editorReadKey();
+  editorDamageAll();
+}
+
 /* Sets up the editing environment */
 void editorRefreshScreen() {
+  editorProfileKey();
+  editorTraceBegin("frame");
+  long long start = editorNow();
   editorScroll();
+  T.stage[STAGE_SCROLL] += editorNow() - start;
   
   struct abuf ab = ABUF_INIT;
 
   abAppend(&ab, "\x1b[?25l", 6);    /* Hides the cursor */
-  abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
+  /* Every view draws its changed lines and its status line */
+  editorSaveView();
+  int j;
+  for (j = 0; j < V.numviews; j++) {
+    start = editorNow();
+    editorTraceBegin("draw");
+    editorDrawRows(&ab, &V.views[j], j == V.current);
+    editorTraceEnd("draw");
+    T.stage[STAGE_DRAW] += editorNow() - start;
+    editorDrawStatusBar(&ab, &V.views[j]);
+  }
   editorDrawMessageBar(&ab);
   
+  eview *v = &V.views[V.current];
   char buf[32];
-  snprintf(buf, sizeof(buf), "x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-	                                   (E.rx - E.coloff) + 1);
+  int line = editorRowToVisual(E.cy) - editorRowToVisual(E.rowoff);  /* Skips folds */
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + line + 1,
+	                                     v->left + (E.rx - E.coloff) + 1);
   abAppend(&ab, buf, strlen(buf));
   
-  abAppend(&ab, "\x1b[25h", 6);     /* Shows the cursor */
+  abAppend(&ab, "\x1b[?25h", 6);    /* Shows the cursor */
 
   /* Writes the buffer's content out to standard output */
-  write(STDOUT_FILENO, ab.b, ab.len);
+  start = editorNow();
+  editorTraceBegin("write");
+  editorWrite(ab.b, ab.len);
+  editorTraceEnd("write");
+  T.stage[STAGE_WRITE] += editorNow() - start;
+  editorProfileFrame(ab.len);
+  editorLatencyPainted();
   abFree(&ab);
+  editorTraceEnd("frame");
 }
 
 /* The ... argument indicates that this is a variadic function, 
@@ -992,6 +5909,9 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /* =============== Input =============== */
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_OTHER
+
 /* Displays a prompt in the status bar, and also allows
  * for the user to input a line of text. Uses a callback 
  * function as an argument, which is called after each 
@@ -1052,6 +5972,57 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+/* Moves the cursor to the end of the next word, or the start of
+ * the last one, going over line breaks as it goes */
+void editorMoveWord(int forward) {
+  while (E.cy < E.numrows) {
+    erow *row = &E.row[E.cy];
+    if (forward) {
+      E.cx = editorSkipClass(row->chars, E.cx, row->size, CLASS_BLANK | CLASS_PUNCT);
+      if (E.cx < row->size) {
+	E.cx = editorSkipClass(row->chars, E.cx, row->size, CLASS_WORD);
+	return;
+      }
+      if (E.cy == E.numrows - 1) return;
+      E.cy++;
+      E.cx = 0;
+    } else {
+      E.cx = editorSkipClassBack(row->chars, E.cx, CLASS_BLANK | CLASS_PUNCT);
+      if (E.cx > 0) {
+	E.cx = editorSkipClassBack(row->chars, E.cx, CLASS_WORD);
+	return;
+      }
+      if (E.cy == 0) return;
+      E.cy--;
+      E.cx = E.row[E.cy].size;
+    }
+  }
+
+  /* Past the last line, going back starts from the end of it */
+  if (!forward && E.numrows > 0) {
+    E.cy = E.numrows - 1;
+    E.cx = E.row[E.cy].size;
+    editorMoveWord(0);
+  }
+}
+
+/* Moves the cursor to the blank line after the paragraph it is in
+ * or the one before it. Whether a line is blank is kept with its 
+ * indent, so lines are only scanned once after they change */
+void editorMoveParagraph(int forward) {
+  int j = E.cy;
+  if (forward) {
+    while (j < E.numrows && editorRowIndent(j) < 0) j++;
+    while (j < E.numrows && editorRowIndent(j) >= 0) j++;
+  } else {
+    if (j > 0) j--;
+    while (j > 0 && (j >= E.numrows || editorRowIndent(j) < 0)) j--;
+    while (j > 0 && editorRowIndent(j) >= 0) j--;
+  }
+  E.cy = j;
+  E.cx = 0;
+}
+
 /* Moves the cursor based on the user's input */ 
 void editorMoveCursor(int key) {
 
@@ -1064,7 +6035,8 @@ void editorMoveCursor(int key) {
       if (E.cx != 0) {
 	E.cx--;
       } else if (E.cy > 0) {            /* Allows the user to move left at the */
-	E.cy--;                         /* start of a line */
+	int vcy = editorRowToVisual(E.cy);  /* start of a line */
+	E.cy = editorVisualToRow(vcy - 1);
 	E.cx = E.row[E.cy].size;
       }
       break;
@@ -1072,20 +6044,29 @@ void editorMoveCursor(int key) {
       if (row && E.cx < row->size) {
 	E.cx++;
       } else if (row && E.cx == row->size) {  /* Allows the user to move right */
-	E.cy++;                               /* at the end of a line */
+	int vcy = editorRowToVisual(E.cy);    /* at the end of a line */
+	E.cy = editorVisualToRow(vcy + 1);
 	E.cx = 0;
       }
       break;
-    case ARROW_UP:
+    case ARROW_UP:                      /* Up and down step over folds */
       if (E.cy != 0) {
-	E.cy--;
+	E.cy = editorVisualToRow(editorRowToVisual(E.cy) - 1);
       }
       break;
     case ARROW_DOWN:
       if (E.cy < E.numrows) {
-	E.cy++;
+	E.cy = editorVisualToRow(editorRowToVisual(E.cy) + 1);
       }
       break;
+    case WORD_LEFT:
+    case WORD_RIGHT:
+      editorMoveWord(key == WORD_RIGHT);
+      break;
+    case PARA_UP:
+    case PARA_DOWN:
+      editorMoveParagraph(key == PARA_DOWN);
+      break;
   }
 
   /* Setting row again because E.cy could point to a different
@@ -1102,6 +6083,262 @@ void editorMoveCursor(int key) {
   }
 }
 
+/* Moves the cursor n times in the direction of the given arrow
+ * key. Vertical moves jump straight to the target line and 
+ * horizontal moves skip over whole lines at a time, instead of 
+ * calling editorMoveCursor(...) n times. Returns the number of
+ * steps that were actually taken */
+int editorMoveCursorRepeat(int key, int n) {
+  int moved = 0;
+
+  /* Up and down count screen lines, which skips over folds */
+  int vcy = editorRowToVisual(E.cy);
+  int vlast = editorRowToVisual(E.numrows);
+  switch (key) {
+    case ARROW_UP:
+      moved = n < vcy ? n : vcy;
+      E.cy = editorVisualToRow(vcy - moved);
+      break;
+    case ARROW_DOWN:
+      moved = n < vlast - vcy ? n : vlast - vcy;
+      E.cy = editorVisualToRow(vcy + moved);
+      break;
+    case ARROW_LEFT:
+      while (moved < n) {
+	if (n - moved <= E.cx) {
+	  E.cx -= n - moved;
+	  moved = n;
+	} else if (E.cy > 0) {        /* Moves to the end of the line above, */
+	  moved += E.cx + 1;          /* which costs the line break as well */
+	  E.cy--;
+	  E.cx = E.row[E.cy].size;
+	} else {
+	  moved += E.cx;
+	  E.cx = 0;
+	  break;
+	}
+      }
+      if (moved > n) {
+	E.cx += moved - n;
+	moved = n;
+      }
+      return moved;
+    case ARROW_RIGHT:
+      while (moved < n && E.cy < E.numrows) {
+	int left = E.row[E.cy].size - E.cx;
+	if (n - moved <= left) {
+	  E.cx += n - moved;
+	  moved = n;
+	} else {                      /* Moves to the start of the next */
+	  moved += left + 1;          /* line, past the line break */
+	  E.cy++;
+	  E.cx = 0;
+	}
+      }
+      if (moved > n) moved = n;
+      return moved;
+  }
+
+  /* Same as in editorMoveCursor(...), E.cx is snapped to the end 
+   * of the line the cursor ended up on */
+  int rowlen = (E.cy >= E.numrows) ? 0 : E.row[E.cy].size;
+  if (E.cx > rowlen) {
+    E.cx = rowlen;
+  }
+  return moved;
+}
+
+/* Places the cursor at a given row and column and sets the row 
+ * offset directly, so that the row ends up in the middle of the 
+ * screen. No intermediate cursor moves are made, which keeps 
+ * long jumps as cheap as short ones */
+void editorSetCursor(int row, int col) {
+  if (row > E.numrows) row = E.numrows;
+  if (row < 0) row = 0;
+  int rowlen = (row >= E.numrows) ? 0 : E.row[row].size;
+  if (col > rowlen) col = rowlen;
+  if (col < 0) col = 0;
+
+  E.cy = row;
+  E.cx = col;
+
+  /* Leaves the rows on screen alone if the target is already
+   * visible, otherwise centers the target row */
+  editorFoldReveal(E.cy);
+  int vcy = editorRowToVisual(E.cy);
+  int vrowoff = editorRowToVisual(E.rowoff);
+  if (vcy < vrowoff || vcy >= vrowoff + E.screenrows) {
+    vrowoff = vcy - E.screenrows / 2;
+    E.rowoff = editorVisualToRow(vrowoff < 0 ? 0 : vrowoff);
+  }
+}
+
+/* Moves the cursor to a line number (starting at 1) */
+void editorGotoLine(int line) {
+  editorSetCursor(line - 1, 0);
+}
+
+/* Moves the cursor to the line that is percent% of the way 
+ * through the file */
+void editorGotoPercent(int percent) {
+  if (percent < 0) percent = 0;
+  if (percent > 100) percent = 100;
+  int row = (int)(((long long)E.numrows * percent) / 100);
+  if (row >= E.numrows && E.numrows > 0) row = E.numrows - 1;
+  editorSetCursor(row, 0);
+}
+
+/* Moves the cursor to the character at a byte offset into the
+ * file, as it would be written by editorSave() */
+void editorGotoByte(size_t offset) {
+  int row = editorByteToRow(offset);
+  if (row >= E.numrows) {
+    editorSetCursor(row, 0);
+    return;
+  }
+  size_t start = editorRowToByte(row);
+  size_t col = offset - start;
+  if (col > (size_t)E.row[row].size) col = E.row[row].size;
+  editorSetCursor(row, (int)col);
+}
+
+/* Moves the cursor n screens up or down, by setting E.cy and 
+ * E.rowoff directly instead of moving line by line. Screens are
+ * counted in screen lines, so folded rows are not paged through */
+void editorPageMove(int key, int n) {
+  long long delta = (long long)E.screenrows * n;
+  long long top = editorRowToVisual(E.rowoff);
+  long long last = editorRowToVisual(E.numrows);
+
+  if (key == PAGE_UP) {
+    long long cy = top - delta;
+    E.cy = editorVisualToRow(cy < 0 ? 0 : (int)cy);
+    long long rowoff = top - delta;
+    E.rowoff = editorVisualToRow(rowoff < 0 ? 0 : (int)rowoff);
+  } else {
+    long long cy = top + E.screenrows - 1 + delta;
+    E.cy = editorVisualToRow(cy > last ? last : (int)cy);
+    long long rowoff = top + delta;
+    E.rowoff = editorVisualToRow(rowoff > last ? last : (int)rowoff);
+  }
+
+  int rowlen = (E.cy >= E.numrows) ? 0 : E.row[E.cy].size;
+  if (E.cx > rowlen) E.cx = rowlen;
+}
+
+/* Prompts for a place to jump to. Accepts a line number, a
+ * percentage of the file ("50%") or a byte offset ("@1024") */
+void editorGoto() {
+  char *query = editorPrompt("Go to: %s (line, N%% or @byte, ESC to cancel)", NULL);
+  if (query == NULL) return;
+  editorPushJump();
+
+  char *end;
+  size_t qlen = strlen(query);
+  if (query[0] == '@') {
+    unsigned long long offset = strtoull(&query[1], &end, 10);
+    if (end != &query[1] && *end == '\0') editorGotoByte((size_t)offset);
+    else editorSetStatusMessage("Invalid byte offset: %s", query);
+  } else if (qlen > 0 && query[qlen - 1] == '%') {
+    long percent = strtol(query, &end, 10);
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+    if (end == &query[qlen - 1] && end != query) editorGotoPercent((int)percent);
+    else editorSetStatusMessage("Invalid percentage: %s", query);
+  } else {
+    long line = strtol(query, &end, 10);
+
+    /* Clamped before the cast, as a long can hold lines an int
+     * cannot, and editorGotoLine() subtracts one */
+    if (line > E.numrows) line = E.numrows;
+    if (line < 1) line = 1;
+    if (end != query && *end == '\0') editorGotoLine((int)line);
+    else editorSetStatusMessage("Invalid line number: %s", query);
+  }
+  free(query);
+}
+
+/* Reads the digits of a repeat count after Ctrl-U was pressed,
+ * showing them in the message bar. The count is returned and
+ * the first key that is not a digit is stored in *key, which 
+ * is the command that gets repeated */
+int editorReadRepeatCount(int *key) {
+  int count = 0;
+  int c;
+
+  while (1) {
+    if (count) editorSetStatusMessage("Repeat: %d", count);
+    else editorSetStatusMessage("Repeat: (type a count, then a command)");
+    editorRefreshScreen();
+
+    c = editorReadKey();
+    if (c >= '0' && c <= '9') {
+      if (count < SPIKE_MAX_REPEAT / 10) count = count * 10 + (c - '0');
+    } else {
+      break;
+    }
+  }
+  editorSetStatusMessage("");
+
+  *key = c;
+
+  /* Ctrl-U on its own repeats the next command 4 times, except
+   * before Ctrl-Y, where the count picks a kill rather than
+   * repeating, and no count means the most recent one */
+  if (count == 0) count = (c == CTRL_KEY('y')) ? 1 : 4;
+  return count;
+}
+
+/* Reads the key after the Ctrl-] prefix and runs the diagnostic 
+ * command it stands for */
+void editorDiagCommand() {
+  editorSetStatusMessage("Diagnostics: p = profiling HUD | a = allocation stats | "
+			 "m = memory | l = key latency | t = write trace");
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 'p':
+      T.show = !T.show;
+      editorSetStatusMessage("Profiling HUD %s: last/p50/p99 per stage in us",
+			     T.show ? "on" : "off");
+      break;
+    case 'a': {
+#ifdef SPIKE_ALLOC_STATS
+      char buf[2048];
+      editorAllocReport(buf, sizeof(buf));
+      editorShowText("Allocations by part of the editor", buf);
+#else
+      editorSetStatusMessage("Allocation stats need a build with make alloc-stats");
+#endif
+      break;
+    }
+    case 'm': {
+      char buf[2048];
+      editorMemoryReport(buf, sizeof(buf));
+      editorShowText("Memory held by the buffers, in bytes", buf);
+      break;
+    }
+    case 'l': {
+      char buf[4096];
+      editorLatencyReport(buf, sizeof(buf));
+      editorShowText("Key to paint latency, in microseconds", buf);
+      break;
+    }
+    case 't': {
+      if (!X.filename) {
+	editorSetStatusMessage("Not tracing, start the editor with --trace FILE");
+	break;
+      }
+      long written = editorTraceDump();
+      if (written == -1) editorSetStatusMessage("Can't write trace: %s", strerror(errno));
+      else editorSetStatusMessage("%ld trace events written to %s", written, X.filename);
+      break;
+    }
+  }
+}
+
 void editorProcessKeypress() {
 
   /* Static variables preserve their previous value in their 
@@ -1109,21 +6346,47 @@ void editorProcessKeypress() {
   static int quit_times = SPIKE_QUIT_TIMES;
 
   int c = editorReadKey();
+  editorTraceBegin("key");
+
+  /* Number of times the command gets repeated */
+  int count = 1;
+  int counted = (c == CTRL_KEY('u'));
+  if (counted) count = editorReadRepeatCount(&c);
+
+  /* Every command starts a new undo group, except for runs of 
+   * typed characters (1) or of deletions (2), which are undone 
+   * all at once */
+  int kind = 0;
+  if (count == 1) {
+    if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) kind = 2;
+    else if (c == '\t' || (c >= ' ' && c < BACKSPACE)) kind = 1;
+  }
+  if (kind == 0 || kind != E.undo.lastkind) editorUndoBoundary();
+  E.undo.lastkind = kind;
+
+  if (E.numcursors > 0 && editorMultiCursorKey(c, count)) {
+    quit_times = SPIKE_QUIT_TIMES;
+    E.lastkill = 0;
+    editorTraceEnd("key");
+    return;
+  }
   
   switch (c) {
     case '\r':                               /* Enter key */
-      editorInsertNewline();   
+      editorInsertNewlineRepeat(count);
       break;
 
     case CTRL_KEY('q'):                      /* Exits the editor program */
-      if (E.dirty && quit_times > 0) {
+      if (editorUnsavedBuffers() && quit_times > 0) {
 	editorSetStatusMessage("WARNING!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
 	quit_times--;
+	editorTraceEnd("key");
 	return;
       }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      editorWrite("\x1b[2J", 4);
+      editorWrite("\x1b[H", 3);
+      editorTraceEnd("key");
       exit(0);
       break;
 
@@ -1144,55 +6407,143 @@ void editorProcessKeypress() {
       editorFind();
       break;
 
+    case CTRL_KEY('z'):                      /* Undoes the last change */
+      while (count--) editorUndo();
+      break;
+
+    case CTRL_KEY('r'):                      /* Redoes the last undone change */
+      while (count--) editorRedo();
+      break;
+
+    case CTRL_KEY('k'):                      /* Kills the rest of the line */
+      editorKillLine(count);
+      break;
+
+    case CTRL_KEY('y'):                      /* Yanks the last kill back */
+      editorYank(count);
+      break;
+
+    case CTRL_KEY('d'):                      /* Deletes the current line */
+      editorDelLines(count);
+      break;
+
+    case CTRL_KEY(' '):                      /* Sets/clears the mark */
+      editorToggleMark();
+      break;
+
+    case CTRL_KEY('w'):                      /* Cuts the region */
+      editorRegionCommand(1);
+      break;
+
+    case CTRL_KEY('c'):                      /* Copies the region */
+      editorRegionCommand(0);
+      break;
+
+    case CTRL_KEY('x'):                      /* Rectangle commands */
+      editorRectCommand();
+      break;
+
+    case CTRL_KEY('b'):                      /* Switches to the next buffer, */
+      if (counted) editorSwitchBuffer(count - 1);   /* or buffer count */
+      else editorSwitchBuffer((B.current + 1) % B.numbufs);
+      break;
+
+    case CTRL_KEY('v'):                      /* Split view commands */
+      editorViewCommand();
+      break;
+
+    case CTRL_KEY('p'):                      /* Bookmarks and jumping back */
+      editorPositionCommand();
+      break;
+
+    case CTRL_KEY('a'):                      /* Folding by indentation */
+      editorFoldCommand();
+      break;
+
+    case CTRL_KEY(']'):                      /* Profiling and statistics */
+      editorDiagCommand();
+      break;
+
+    case CTRL_KEY('n'):                      /* Completes the word before */
+      editorComplete();                      /* the cursor */
+      break;
+
+    case CTRL_KEY('o'):                      /* Sorts, uniqs or reverses */
+      editorLineCommand();                   /* lines */
+      break;
+
+    case CTRL_KEY('t'):                      /* Adds a cursor at the next */
+      editorAddCursorAtNextMatch();          /* match of the word/region */
+      break;
+
+    case CTRL_KEY('e'):                      /* Adds a cursor on each */
+      editorAddCursorsOnRegion();            /* line of the region */
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
-      if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
-      editorDelChar();
+      if (E.markset) {                       /* Deletes the region */
+	editorRegionCommand(2);
+	break;
+      }
+      if (c == DEL_KEY) count = editorMoveCursorRepeat(ARROW_RIGHT, count);
+      editorDelCharRepeat(count);
       break;
       
-    /* Simulates Page up/down by inputting ARROW_UP/DOWN many times */
+    /* Scrolls a whole screen up/down at a time */
     case PAGE_UP:
     case PAGE_DOWN:
-      {
-	if (c == PAGE_UP) {
-	  E.cy = E.rowoff;
-	} else if (c == PAGE_DOWN) {
-	  E.cy = E.rowoff + E.screenrows - 1;
-	  if (E.cy > E.numrows) E.cy = E.numrows;
-	}
-	
-	int times = E.screenrows;
+      editorPageMove(c, count);
+      break;
 
-	/* ?: as a ternary operator -> "if a then b, otherwise c" */
-        while (times--)
-	  editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
+    case CTRL_KEY('g'):                      /* Jumps to a line, percentage */
+      editorGoto();                          /* or byte offset */
       break;
       
     case ARROW_UP:
     case ARROW_DOWN:
     case ARROW_LEFT:
     case ARROW_RIGHT:
-      editorMoveCursor(c);
+      if (count == 1) editorMoveCursor(c);
+      else editorMoveCursorRepeat(c, count);
+      break;
+
+    case WORD_LEFT:
+    case WORD_RIGHT:
+    case PARA_UP:
+    case PARA_DOWN:
+      while (count--) editorMoveCursor(c);
       break;
 
     case CTRL_KEY('l'):
-    case '\x1b':
+      break;
+
+    case '\x1b':                             /* Clears the mark and */
+      E.markset = 0;                         /* the extra cursors */
+      E.rectmode = 0;
+      editorClearCursors();
       break;
       
     default:
-      editorInsertChar(c);
+      if (count == 1) editorInsertChar(c);
+      else editorInsertCharRepeat(c, count);
       break;
   }
 
   /* Gets reset back to 3 when any key other than Ctrl-Q is pressed */
   quit_times = SPIKE_QUIT_TIMES;
+
+  /* Kills made one after another are collected into one entry */
+  E.lastkill = (c == CTRL_KEY('k'));
+  E.lastcomplete = (c == CTRL_KEY('n'));
+  editorTraceEnd("key");
 }
 
 /* =============== Init =============== */
 
-void initEditor() {
+/* Sets up the state of an empty buffer in E */
+void initBuffer() {
   E.cx = 0;
   E.cy = 0;
   E.rx = 0;
@@ -1200,26 +6551,130 @@ void initEditor() {
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
+  E.lineoff = NULL;
+  E.lineoff_valid = 0;
   E.dirty = 0;
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.group = 1;
+  E.markset = 0;
+  E.cursors = NULL;
+  E.numcursors = 0;
+  E.cursorcap = 0;
+  E.rectmode = 0;
+  memset(&E.words, 0, sizeof(E.words));
+  E.wordbuild = NULL;
+  E.renderbytes = 0;
+  E.charbytes = 0;
+  E.sharedbytes = 0;
+  E.slack = 0;
+  E.lastused = 0;
+  E.generation = 0;
+  memset(&E.shifts, 0, sizeof(E.shifts));
+  E.bookmarks = NULL;
+  E.numbookmarks = 0;
+  E.numjumps = 0;
+  E.jumppos = 0;
+  memset(&E.folds, 0, sizeof(E.folds));
+  E.completion.n = 0;
+  E.lastcomplete = 0;
   E.filename = NULL;        /* Will stay NULL if a file is not opened */
+}
+
+void initEditor() {
+  initBuffer();
+  E.killlen = 0;
+  E.lastkill = 0;
+  E.rectkill = NULL;
   E.statusmsg[0] = '\0';    /* No message will be displayed by default */
   E.statusmsg_time = 0;
   
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  editorInitCharClass();
+  pthread_mutex_init(&T.lock, NULL);
+#ifdef SPIKE_ALLOC_STATS
+  atexit(editorAllocAtExit);
+#endif
+  if (R.headless) {
+    E.screenrows = R.rows;
+    E.screencols = R.cols;
+  } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+    die("getWindowSize");
+  }
+  editorInitViews(E.screenrows, E.screencols);
+  editorListen(editorLineIndexChanged);
+  editorListen(editorViewsChanged);
+  editorListen(editorAnchorsChanged);
+  editorListen(editorFoldsChanged);
 
   /* Gets decremented so that editorDrawRows() does not
    * draw lines of text at the bottom of the screen */
   E.screenrows -= 2;
+
+  B.bufs = malloc(sizeof(struct editorConfig));
+  B.numbufs = 1;
+  B.current = 0;
+  B.clock = 0;
 }
 
+/* The benchmarks in bench/ include this file with SPIKE_NO_MAIN
+ * defined and drive the editor from a main of their own */
+#ifndef SPIKE_NO_MAIN
 int main(int argc, char *argv[]) {
-  enableRawMode();
+
+  /* Options can go anywhere among the names of the files */
+  char **files = malloc(sizeof(char *) * argc);
+  int numfiles = 0;
+  int j;
+  R.rows = 24;
+  R.cols = 80;
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "--headless") == 0) {
+      R.headless = 1;
+    } else if (j + 1 < argc && strcmp(argv[j], "--replay") == 0) {
+      editorReplayLoad(argv[++j]);
+    } else if (j + 1 < argc && strcmp(argv[j], "--record") == 0) {
+      R.record = fopen(argv[++j], "wb");
+      if (!R.record) die("fopen");
+    } else if (j + 1 < argc && strcmp(argv[j], "--size") == 0) {
+      if (sscanf(argv[++j], "%dx%d", &R.rows, &R.cols) != 2 || R.rows < 3 || R.cols < 1) {
+	fprintf(stderr, "--size takes ROWSxCOLS, e.g. 50x200\n");
+	free(files);
+	return 1;
+      }
+    } else if (j + 1 < argc && strcmp(argv[j], "--trace") == 0) {
+      editorTraceStart(argv[++j]);
+    } else if (j + 1 < argc && strcmp(argv[j], "--file") == 0) {
+      files[numfiles++] = argv[++j];
+    } else {
+      files[numfiles++] = argv[j];
+    }
+  }
+  if (R.headless && !R.keys) {
+    fprintf(stderr, "--headless needs keys to replay, from --replay keys.bin\n");
+    free(files);
+    return 1;
+  }
+
+  if (!R.headless) enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  if (X.filename) {
+    editorTraceName("main");
+    atexit(editorTraceAtExit);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  /* Every file given gets a buffer, the first one is shown */
+  for (j = 0; j < numfiles; j++) {
+    if (j > 0) editorNewBuffer();
+    editorOpen(files[j]);
+  }
+  if (numfiles > 1) editorSwitchBuffer(0);
+  free(files);
+
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-U = repeat");
+
+  if (R.keys) {
+    atexit(editorReplayReport);
+    R.start = editorNow();
+  }
   
   while (1) {
     editorRefreshScreen();
@@ -1228,3 +6683,4 @@ int main(int argc, char *argv[]) {
   
   return 0;
 }
+#endif
@@ -0,0 +1,148 @@
+/* =============== Corpus Generator =============== */
+
+/* Writes the files the benchmarks are run on. Every corpus has the
+ * word "lorem" in it many times, for replace-all, and the marker
+ * SPIKE_BENCH_MARK once, about nine tenths of the way through, for
+ * search. The scale divides the size of every corpus, so that the
+ * suite can be tried out quickly with a scale of 100 or so
+ *
+ *   gen lines|long|tsv|log|json FILE [SCALE] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+  "adipiscing", "elit", "sed", "do", "eiusmod", "tempor" };
+#define NUMWORDS (sizeof(words) / sizeof(words[0]))
+
+/* A small generator of its own, so that the corpora are the same
+ * on every machine */
+static unsigned long long seed = 88172645463325252ULL;
+unsigned int genRandom() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (unsigned int)(seed >> 32);
+}
+
+/* Writes the marker when the count passes nine tenths of total */
+void genMark(FILE *fp, long long at, long long total) {
+  if (at == total * 9 / 10) fputs("SPIKE_BENCH_MARK ", fp);
+}
+
+/* 10M short lines */
+void genLines(FILE *fp, long long scale) {
+  long long n = 10000000 / scale, j;
+  for (j = 0; j < n; j++) {
+    genMark(fp, j, n);
+    fprintf(fp, "%s %lld\n", words[genRandom() % NUMWORDS], j);
+  }
+}
+
+/* A few lines of 100 MB each */
+void genLong(FILE *fp, long long scale) {
+  long long size = 100000000 / scale;
+  int line;
+  for (line = 0; line < 3; line++) {
+    long long len = 0, w = 0;
+    while (len < size) {
+      if (line == 2) genMark(fp, w, size / 6);
+      const char *word = words[genRandom() % NUMWORDS];
+      fputs(word, fp);
+      fputc(' ', fp);
+      len += strlen(word) + 1;
+      w++;
+    }
+    fputc('\n', fp);
+  }
+}
+
+/* A tab separated table, 1M rows of 12 fields */
+void genTsv(FILE *fp, long long scale) {
+  long long n = 1000000 / scale, j;
+  int k;
+  for (j = 0; j < n; j++) {
+    genMark(fp, j, n);
+    for (k = 0; k < 12; k++) {
+      if (k % 3 == 0) fprintf(fp, "%u", genRandom() % 100000);
+      else fputs(words[genRandom() % NUMWORDS], fp);
+      fputc(k == 11 ? '\n' : '\t', fp);
+    }
+  }
+}
+
+/* 2M lines of a log, which repeat with small changes */
+void genLog(FILE *fp, long long scale) {
+  static const char *levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG", "ERROR" };
+  long long n = 2000000 / scale, j;
+  for (j = 0; j < n; j++) {
+    genMark(fp, j, n);
+    fprintf(fp, "2024-01-%02lld %02lld:%02lld:%02lld.%03u %-5s [worker-%u] request %lld "
+	    "handled in %ums (%s)\n", j / 86400 % 28 + 1, j / 3600 % 24, j / 60 % 60, j % 60,
+	    genRandom() % 1000, levels[genRandom() % 6], genRandom() % 16, j,
+	    genRandom() % 500, words[genRandom() % NUMWORDS]);
+  }
+}
+
+/* JSON nested 64 levels deep, written out with indentation, in
+ * blocks that repeat until about 1M lines are written */
+void genJsonLevel(FILE *fp, int depth, long long *lines) {
+  int indent = depth * 2;
+  fprintf(fp, "%*s{\n", indent, "");
+  fprintf(fp, "%*s\"%s\": \"%s %lld\",\n", indent + 2, "", words[genRandom() % NUMWORDS],
+	  words[genRandom() % NUMWORDS], *lines);
+  fprintf(fp, "%*s\"items\": [1, 2, 3],\n", indent + 2, "");
+  *lines += 3;
+  if (depth < 63) {
+    fprintf(fp, "%*s\"child\":\n", indent + 2, "");
+    (*lines)++;
+    genJsonLevel(fp, depth + 1, lines);
+  } else {
+    fprintf(fp, "%*s\"leaf\": true\n", indent + 2, "");
+    (*lines)++;
+  }
+  fprintf(fp, "%*s}%s\n", indent, "", depth ? "" : ",");
+  (*lines)++;
+}
+
+void genJson(FILE *fp, long long scale) {
+  long long total = 1000000 / scale, lines = 0;
+  int marked = 0;
+  fputs("[\n", fp);
+  while (lines < total) {
+    if (!marked && lines >= total * 9 / 10) {
+      fputs("\"SPIKE_BENCH_MARK\",\n", fp);
+      marked = 1;
+    }
+    genJsonLevel(fp, 0, &lines);
+  }
+  fputs("null\n]\n", fp);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: gen lines|long|tsv|log|json FILE [SCALE]\n");
+    return 1;
+  }
+  long long scale = argc > 3 ? atoll(argv[3]) : 1;
+  if (scale < 1) scale = 1;
+
+  FILE *fp = fopen(argv[2], "w");
+  if (!fp) {
+    perror(argv[2]);
+    return 1;
+  }
+  if (strcmp(argv[1], "lines") == 0) genLines(fp, scale);
+  else if (strcmp(argv[1], "long") == 0) genLong(fp, scale);
+  else if (strcmp(argv[1], "tsv") == 0) genTsv(fp, scale);
+  else if (strcmp(argv[1], "log") == 0) genLog(fp, scale);
+  else if (strcmp(argv[1], "json") == 0) genJson(fp, scale);
+  else {
+    fprintf(stderr, "gen: unknown corpus %s\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,235 @@
+/* =============== Microbenchmarks =============== */
+
+/* Times the functions the editor spends most of its time in, each
+ * on its own, over rows made up to order: LEN bytes long, with a
+ * fraction TABS of tabs and DIGITS of digits, the rest being words
+ * and spaces. Every benchmark makes a number of passes over all
+ * the rows, the first WARMUP of which are not counted, and reports
+ * nanoseconds per row as the median, minimum, mean and relative
+ * standard deviation of the passes, with the throughput of the
+ * median in MB of row bytes per second
+ *
+ *   micro [--rows N] [--len N] [--tabs F] [--digits F] [--reps N]
+ *         [--warmup N] [--only NAME] */
+
+#define SPIKE_NO_MAIN
+#include "../Spike.c"
+
+#include <math.h>
+
+#define MICRO_MARK "MICRO_MARK"       /* Only in the last row, so a search scans them all */
+#define MICRO_FRAME 50                /* Rows appended to an abuf per frame */
+
+struct microConfig {
+  int rows, len;
+  double tabs, digits;
+  int reps, warmup;
+  const char *only;
+};
+
+static const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+  "adipiscing", "elit", "sed", "do", "eiusmod", "tempor" };
+#define NUMWORDS (sizeof(words) / sizeof(words[0]))
+
+/* A small generator of its own, so that every run gets the same rows */
+static unsigned long long seed = 88172645463325252ULL;
+unsigned int microRandom() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (unsigned int)(seed >> 32);
+}
+
+/* Loads the rows into the editor the way editorOpen() would. Rows
+ * are made of tabs, numbers and words separated by spaces, each
+ * token being whichever of them is furthest below its share of the
+ * bytes so far, so that the word index is as large as it is for
+ * real text and not one word per row */
+void microRows(struct microConfig *cfg) {
+  char *line = malloc(cfg->len + sizeof(MICRO_MARK));
+  E.undo.suspended++;
+  E.words.suspended++;
+  long tabs = 0, digits = 0, total = 0;
+  int j, k;
+  for (j = 0; j < cfg->rows; j++) {
+    k = 0;
+    while (k < cfg->len) {
+      if (tabs < cfg->tabs * total) {
+	line[k++] = '\t';
+	tabs++;
+	total++;
+	continue;
+      }
+
+      char token[32];
+      int len, isnum = digits < cfg->digits * total;
+      if (isnum) len = snprintf(token, sizeof(token), "%u ", microRandom() % 10000);
+      else len = snprintf(token, sizeof(token), "%s ", words[microRandom() % NUMWORDS]);
+      if (len > cfg->len - k) len = cfg->len - k;
+      memcpy(&line[k], token, len);
+      k += len;
+      total += len;
+      if (isnum) digits += token[len - 1] == ' ' ? len - 1 : len;
+    }
+    int len = cfg->len;
+    if (j == cfg->rows - 1) {
+      memcpy(&line[len], MICRO_MARK, strlen(MICRO_MARK));
+      len += strlen(MICRO_MARK);
+    }
+    editorInsertRow(E.numrows, line, len);
+  }
+  E.undo.suspended--;
+  E.words.suspended--;
+  free(line);
+}
+
+void benchUpdateRow() {
+  int j;
+  for (j = 0; j < E.numrows; j++) editorUpdateRow(&E.row[j]);
+}
+
+void benchUpdateSyntax() {
+  int j;
+  for (j = 0; j < E.numrows; j++) editorUpdateSyntax(&E.row[j]);
+}
+
+/* The results are summed so that the calls are not optimized away */
+volatile long microSink;
+
+void benchCxToRx() {
+  long sum = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) sum += editorRowCxToRx(&E.row[j], E.row[j].size);
+  microSink = sum;
+}
+
+void benchRxToCx() {
+  long sum = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) sum += editorRowRxToCx(&E.row[j], E.row[j].rsize);
+  microSink = sum;
+}
+
+/* Appends rows the way editorDrawRows() does, a frame at a time */
+void benchAbAppend() {
+  struct abuf ab = ABUF_INIT;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    abAppend(&ab, E.row[j].render, E.row[j].rsize);
+    abAppend(&ab, "\x1b[K", 3);
+    abAppend(&ab, "\r\n", 2);
+    if ((j + 1) % MICRO_FRAME == 0) {
+      abFree(&ab);
+      ab.b = NULL;
+      ab.len = 0;
+    }
+  }
+  abFree(&ab);
+}
+
+void benchRowsToString() {
+  int len;
+  free(editorRowsToString(&len));
+  microSink = len;
+}
+
+/* Searches the way typing into the Ctrl-F prompt does, for a
+ * string only the last row has */
+void benchSearch() {
+  char query[] = MICRO_MARK;
+  editorFindCallback(query, 0);
+  editorFindCallback(query, '\r');
+  microSink = E.cy;
+}
+
+struct microBench {
+  const char *name;
+  void (*fn)();
+};
+
+static struct microBench benches[] = {
+  { "updateRow", benchUpdateRow },
+  { "updateSyntax", benchUpdateSyntax },
+  { "cxToRx", benchCxToRx },
+  { "rxToCx", benchRxToCx },
+  { "abAppend", benchAbAppend },
+  { "rowsToString", benchRowsToString },
+  { "search", benchSearch },
+};
+
+int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Runs one benchmark and prints its line of the results */
+void microRun(struct microConfig *cfg, struct microBench *b, size_t bytes) {
+  double *ns = malloc(sizeof(double) * cfg->reps);
+  int j;
+  for (j = 0; j < cfg->warmup; j++) b->fn();
+  for (j = 0; j < cfg->reps; j++) {
+    long long start = editorNow();
+    b->fn();
+    ns[j] = (double)(editorNow() - start) / E.numrows;
+  }
+
+  double mean = 0, var = 0;
+  for (j = 0; j < cfg->reps; j++) mean += ns[j];
+  mean /= cfg->reps;
+  for (j = 0; j < cfg->reps; j++) var += (ns[j] - mean) * (ns[j] - mean);
+  double sd = cfg->reps > 1 ? sqrt(var / (cfg->reps - 1)) : 0;
+  qsort(ns, cfg->reps, sizeof(double), compareDouble);
+  double median = ns[cfg->reps / 2];
+
+  printf("%-14s %12.1f %12.1f %12.1f %7.1f%% %10.1f\n", b->name, median, ns[0], mean,
+	 mean > 0 ? 100 * sd / mean : 0, median > 0 ? bytes / (median * E.numrows) * 1e3 : 0);
+  free(ns);
+}
+
+void usage() {
+  fprintf(stderr, "usage: micro [--rows N] [--len N] [--tabs F] [--digits F] [--reps N] "
+	  "[--warmup N] [--only NAME]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct microConfig cfg = { 100000, 80, 0.05, 0.1, 20, 3, NULL };
+  int j;
+  for (j = 1; j < argc; j++) {
+    if (j + 1 >= argc) usage();
+    if (strcmp(argv[j], "--rows") == 0) cfg.rows = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--len") == 0) cfg.len = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--tabs") == 0) cfg.tabs = atof(argv[++j]);
+    else if (strcmp(argv[j], "--digits") == 0) cfg.digits = atof(argv[++j]);
+    else if (strcmp(argv[j], "--reps") == 0) cfg.reps = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--warmup") == 0) cfg.warmup = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--only") == 0) cfg.only = argv[++j];
+    else usage();
+  }
+  if (cfg.rows < 1 || cfg.len < 0 || cfg.reps < 1 || cfg.warmup < 0 ||
+      cfg.tabs < 0 || cfg.digits < 0 || cfg.tabs + cfg.digits > 1) usage();
+
+  R.headless = 1;
+  R.rows = 50;
+  R.cols = 200;
+  initEditor();
+  microRows(&cfg);
+
+  /* Every row is rendered before anything is timed, as the search
+   * and the render index conversions expect them to be */
+  size_t bytes = 0;
+  for (j = 0; j < E.numrows; j++) {
+    editorRowRender(&E.row[j]);
+    bytes += E.row[j].size;
+  }
+
+  printf("rows %d, len %d, tabs %.2f, digits %.2f, %d reps after %d warm-up\n",
+	 cfg.rows, cfg.len, cfg.tabs, cfg.digits, cfg.reps, cfg.warmup);
+  printf("%-14s %12s %12s %12s %8s %10s\n", "ns/row", "median", "min", "mean", "stddev",
+	 "MB/s");
+  for (j = 0; j < (int)(sizeof(benches) / sizeof(benches[0])); j++) {
+    if (cfg.only && strcmp(cfg.only, benches[j].name) != 0) continue;
+    microRun(&cfg, &benches[j], bytes);
+  }
+  return 0;
+}
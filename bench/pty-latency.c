@@ -0,0 +1,338 @@
+/* =============== PTY Latency =============== */
+
+/* Runs the editor on a pseudo-terminal and types into it, to time
+ * what a user would see: from a key being written to the terminal
+ * to the frame that shows it having been read back. The output is
+ * fed through a small VT emulator, which keeps the screen and the
+ * cursor. A key counts as painted at the end of the first frame
+ * (the cursor being shown again) that has the cursor past it and
+ * the key on the screen. Keys are typed at the top of the file,
+ * LINE to a line, and are sent at a fixed rate in keys per second
+ * or, with a rate of 0, each once the one before has been painted
+ *
+ *   pty-latency [--spike PATH] [--size ROWSxCOLS] [--keys N]
+ *               [--rate KPS] [--line LEN] [FILE] */
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ROWS 200
+#define MAX_COLS 400
+#define KEY_TIMEOUT 2000000000LL    /* Nanoseconds a key may take to be painted */
+#define SETTLE 200000000LL          /* Quiet time after the first frame before typing */
+
+/* The screen as the VT emulator has it */
+struct vt {
+  char cells[MAX_ROWS][MAX_COLS];
+  int rows, cols;
+  int cx, cy;                   /* Cursor, from 0 */
+  int state;                    /* 0 text, 1 after ESC, 2 in a CSI sequence */
+  int params[8], numparams;
+  int private;                  /* Whether the CSI sequence started with '?' */
+  int frames;                   /* Frames ended, by the cursor being shown */
+};
+
+/* A key typed and where it should show up */
+struct key {
+  char c;
+  int row, col;                 /* Cell the key lands in, -1 for Enter */
+  int after;                    /* Cursor position once it is painted, as row * MAX_COLS + col */
+  long long sent, painted;
+};
+
+long long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int clamp(int v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+void vtClear(struct vt *t, int row, int from, int to) {
+  if (from < to) memset(&t->cells[row][from], ' ', to - from);
+}
+
+/* Runs a CSI sequence that has ended with final */
+void vtCsi(struct vt *t, char final, int fd) {
+  int p0 = t->numparams > 0 ? t->params[0] : 0;
+  int p1 = t->numparams > 1 ? t->params[1] : 0;
+  int j;
+  switch (final) {
+    case 'H':
+    case 'f':
+      t->cy = clamp((p0 ? p0 : 1) - 1, 0, t->rows - 1);
+      t->cx = clamp((p1 ? p1 : 1) - 1, 0, t->cols - 1);
+      break;
+    case 'A': t->cy = clamp(t->cy - (p0 ? p0 : 1), 0, t->rows - 1); break;
+    case 'B': t->cy = clamp(t->cy + (p0 ? p0 : 1), 0, t->rows - 1); break;
+    case 'C': t->cx = clamp(t->cx + (p0 ? p0 : 1), 0, t->cols - 1); break;
+    case 'D': t->cx = clamp(t->cx - (p0 ? p0 : 1), 0, t->cols - 1); break;
+    case 'J':
+      if (p0 == 2) {
+	for (j = 0; j < t->rows; j++) vtClear(t, j, 0, t->cols);
+      } else {
+	vtClear(t, t->cy, t->cx, t->cols);
+	for (j = t->cy + 1; j < t->rows; j++) vtClear(t, j, 0, t->cols);
+      }
+      break;
+    case 'K':
+      vtClear(t, t->cy, t->cx, t->cols);
+      break;
+    case 'h':
+      if (t->private && p0 == 25) t->frames++;
+      break;
+    case 'n':
+      if (p0 == 6) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dR", t->cy + 1, t->cx + 1);
+	if (write(fd, buf, len) != len) perror("write");
+      }
+      break;
+  }
+}
+
+/* Feeds a byte of output to the emulator. Returns 1 if it ended a
+ * frame. Colours and other attributes are ignored */
+int vtByte(struct vt *t, unsigned char c, int fd) {
+  int frames = t->frames;
+  if (t->state == 1) {
+    t->state = c == '[' ? 2 : 0;
+    t->numparams = 0;
+    t->private = 0;
+    memset(t->params, 0, sizeof(t->params));
+  } else if (t->state == 2) {
+    if (c == '?') {
+      t->private = 1;
+    } else if (c >= '0' && c <= '9') {
+      if (t->numparams == 0) t->numparams = 1;
+      t->params[t->numparams - 1] = t->params[t->numparams - 1] * 10 + (c - '0');
+    } else if (c == ';') {
+      if (t->numparams == 0) t->numparams = 1;
+      if (t->numparams < 8) t->numparams++;
+    } else if (c >= 0x40 && c <= 0x7e) {
+      vtCsi(t, c, fd);
+      t->state = 0;
+    }
+  } else if (c == '\x1b') {
+    t->state = 1;
+  } else if (c == '\r') {
+    t->cx = 0;
+  } else if (c == '\n') {
+    if (t->cy < t->rows - 1) t->cy++;
+  } else if (c == '\b') {
+    if (t->cx > 0) t->cx--;
+  } else if (c >= ' ') {
+    t->cells[t->cy][t->cx] = c;
+    if (t->cx < t->cols - 1) t->cx++;
+  }
+  return t->frames != frames;
+}
+
+/* Whether the screen shows a key, given that a frame just ended */
+int keyPainted(struct vt *t, struct key *k) {
+  if (t->cy * MAX_COLS + t->cx < k->after) return 0;
+  return k->row < 0 || t->cells[k->row][k->col] == k->c;
+}
+
+int compareLongLong(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/* Starts the editor on the slave side of a new pseudo-terminal and
+ * returns the master side */
+int startEditor(const char *spike, const char *file, int rows, int cols, pid_t *pid) {
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = rows;
+  ws.ws_col = cols;
+
+  int master, slave;
+  if (openpty(&master, &slave, NULL, NULL, &ws) == -1) {
+    perror("openpty");
+    exit(1);
+  }
+
+  *pid = fork();
+  if (*pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (*pid == 0) {
+    close(master);
+    setsid();
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    if (slave > STDERR_FILENO) close(slave);
+    execl(spike, spike, file, (char *)NULL);
+    perror(spike);
+    _exit(127);
+  }
+  close(slave);
+  return master;
+}
+
+/* Reads what the editor has written, waiting up to timeout ns for
+ * it. Returns the number of bytes read, or -1 once it has exited.
+ * Keys sent from next on are marked painted, in order, at the end
+ * of the first frame that shows them */
+long readOutput(int fd, struct vt *t, long long timeout, struct key *keys, int *next, int sent) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int ms = timeout > 0 ? (int)((timeout + 999999) / 1000000) : 0;
+  if (poll(&pfd, 1, ms) <= 0) return 0;
+
+  unsigned char buf[65536];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  if (n <= 0) return n == -1 && errno == EINTR ? 0 : -1;
+
+  long long at = now();
+  ssize_t j;
+  for (j = 0; j < n; j++) {
+    if (!vtByte(t, buf[j], fd) || keys == NULL) continue;
+    while (*next < sent && keyPainted(t, &keys[*next])) keys[(*next)++].painted = at;
+  }
+  return n;
+}
+
+void usage() {
+  fprintf(stderr, "usage: pty-latency [--spike PATH] [--size ROWSxCOLS] [--keys N] "
+	  "[--rate KPS] [--line LEN] [FILE]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *spike = "./Spike", *file = NULL;
+  int rows = 40, cols = 120, numkeys = 500, line = 40;
+  double rate = 0;
+  int j;
+  for (j = 1; j < argc; j++) {
+    if (j + 1 < argc && strcmp(argv[j], "--spike") == 0) spike = argv[++j];
+    else if (j + 1 < argc && strcmp(argv[j], "--keys") == 0) numkeys = atoi(argv[++j]);
+    else if (j + 1 < argc && strcmp(argv[j], "--rate") == 0) rate = atof(argv[++j]);
+    else if (j + 1 < argc && strcmp(argv[j], "--line") == 0) line = atoi(argv[++j]);
+    else if (j + 1 < argc && strcmp(argv[j], "--size") == 0) {
+      if (sscanf(argv[++j], "%dx%d", &rows, &cols) != 2) usage();
+    } else if (argv[j][0] == '-') usage();
+    else file = argv[j];
+  }
+  if (rows < 4 || rows > MAX_ROWS || cols < 8 || cols > MAX_COLS || numkeys < 1) usage();
+  if (line < 1 || line > cols - 2) line = cols - 2;
+
+  /* Lines are ended with Enter, and all of them have to fit above
+   * the status bar so that the view does not scroll */
+  if ((numkeys + line) / (line + 1) > rows - 3) {
+    fprintf(stderr, "pty-latency: %d keys do not fit on %d rows, use a larger --size "
+	    "or --line\n", numkeys, rows);
+    return 1;
+  }
+  struct key *keys = calloc(numkeys, sizeof(struct key));
+  int row = 0, col = 0;
+  for (j = 0; j < numkeys; j++) {
+    if (col == line) {
+      keys[j].c = '\r';
+      keys[j].row = -1;
+      row++;
+      col = 0;
+    } else {
+      keys[j].c = 'a' + j % 26;
+      keys[j].row = row;
+      keys[j].col = col++;
+    }
+    keys[j].after = row * MAX_COLS + col;
+  }
+
+  struct vt *t = calloc(1, sizeof(struct vt));
+  t->rows = rows;
+  t->cols = cols;
+  for (j = 0; j < rows; j++) vtClear(t, j, 0, cols);
+
+  pid_t pid;
+  int fd = startEditor(spike, file, rows, cols, &pid);
+
+  /* Waits for the first frame and for the editor to go quiet */
+  long long start = now(), quiet = 0;
+  while (t->frames == 0 || now() - quiet < SETTLE) {
+    long n = readOutput(fd, t, SETTLE, NULL, NULL, 0);
+    if (n == -1 || now() - start > 10 * KEY_TIMEOUT) {
+      fprintf(stderr, "pty-latency: %s did not start\n", spike);
+      return 1;
+    }
+    if (n > 0) quiet = now();
+  }
+
+  int sent = 0, next = 0, frames = t->frames;
+  long bytes = 0;
+  start = now();
+  while (next < numkeys) {
+    long long at = now();
+    long long due = rate > 0 ? start + (long long)(sent * 1e9 / rate) : 0;
+    if (sent < numkeys && (rate > 0 ? at >= due : next == sent)) {
+      keys[sent].sent = now();
+      if (write(fd, &keys[sent].c, 1) != 1) {
+	perror("write");
+	return 1;
+      }
+      sent++;
+      continue;
+    }
+    if (sent > next && at - keys[next].sent > KEY_TIMEOUT) {
+      fprintf(stderr, "pty-latency: key %d ('%c') was not painted\n", next,
+	      keys[next].c == '\r' ? 'M' : keys[next].c);
+      kill(pid, SIGKILL);
+      return 1;
+    }
+    long long wait = sent < numkeys && rate > 0 ? due - at : 10000000;
+    long n = readOutput(fd, t, wait, keys, &next, sent);
+    if (n == -1) {
+      fprintf(stderr, "pty-latency: %s exited\n", spike);
+      return 1;
+    }
+    bytes += n;
+  }
+  long long total = now() - start;
+  frames = t->frames - frames;
+
+  /* The file was changed, so the editor is not asked to quit */
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(fd);
+
+  long long *lat = malloc(sizeof(long long) * numkeys), sum = 0;
+  for (j = 0; j < numkeys; j++) {
+    lat[j] = keys[j].painted - keys[j].sent;
+    sum += lat[j];
+  }
+  qsort(lat, numkeys, sizeof(long long), compareLongLong);
+
+  printf("keys %d\n", numkeys);
+  printf("rate_kps %g\n", rate);
+  printf("frames %d\n", frames);
+  printf("total_us %lld\n", total / 1000);
+  printf("latency_mean_us %lld\n", sum / numkeys / 1000);
+  printf("latency_p50_us %lld\n", lat[numkeys / 2] / 1000);
+  printf("latency_p90_us %lld\n", lat[(numkeys * 9) / 10] / 1000);
+  printf("latency_p99_us %lld\n", lat[(numkeys * 99) / 100] / 1000);
+  printf("latency_max_us %lld\n", lat[numkeys - 1] / 1000);
+  printf("bytes_out %ld\n", bytes);
+  printf("bytes_per_key %.1f\n", (double)bytes / numkeys);
+  free(lat);
+  free(keys);
+  free(t);
+  return 0;
+}
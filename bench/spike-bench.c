@@ -0,0 +1,174 @@
+/* =============== Benchmarks =============== */
+
+/* Times the main operations of the editor on each corpus given,
+ * and prints the results as JSON so that runs on different commits
+ * can be compared. The editor is included whole, without its main,
+ * and runs headless: frames are made as usual but only counted.
+ * Each corpus is run in a process of its own, so that one does not
+ * start with the memory left behind by another
+ *
+ *   spike-bench [--label LABEL] CORPUS... */
+
+#define SPIKE_NO_MAIN
+#include "../Spike.c"
+
+#include <sys/wait.h>
+
+#define BENCH_MARK "SPIKE_BENCH_MARK"
+#define BENCH_FIND "lorem"
+#define BENCH_REPLACE "LOREM_IPSUM"
+#define BENCH_PAGES 1000      /* Screens scrolled through */
+#define BENCH_TYPED 100       /* Characters typed at the top and at the bottom */
+
+/* Feeds keys through editorProcessKeypress() as a replay would,
+ * drawing a frame after each command */
+void benchKeys(const char *keys, size_t len) {
+  R.keys = (char *)keys;
+  R.len = len;
+  R.pos = 0;
+  while (R.pos < R.len) {
+    editorProcessKeypress();
+    editorRefreshScreen();
+  }
+  R.keys = NULL;
+}
+
+/* Replaces every BENCH_FIND in the file. The editor has no replace
+ * command, so this does what one would: each row with a match is
+ * rebuilt once and swapped in through the row operations, which
+ * keeps the undo log and the change listeners up to date */
+long long benchReplaceAll() {
+  size_t flen = strlen(BENCH_FIND), rlen = strlen(BENCH_REPLACE);
+  long long count = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    char *match = memmem(row->chars, row->size, BENCH_FIND, flen);
+    if (match == NULL) continue;
+
+    struct abuf ab = ABUF_INIT;
+    char *from = row->chars, *end = row->chars + row->size;
+    while (match) {
+      abAppend(&ab, from, match - from);
+      abAppend(&ab, BENCH_REPLACE, rlen);
+      from = match + flen;
+      count++;
+      match = memmem(from, end - from, BENCH_FIND, flen);
+    }
+    abAppend(&ab, from, end - from);
+    editorRowDelChars(row, 0, row->size);
+    editorRowInsertChars(row, 0, ab.b, ab.len);
+    abFree(&ab);
+  }
+  return count;
+}
+
+/* Runs every benchmark on one corpus and prints its JSON object */
+void benchCorpus(const char *path) {
+  R.headless = 1;
+  R.rows = 50;
+  R.cols = 200;
+  initEditor();
+
+  long long t = editorNow();
+  editorOpen((char *)path);
+  long long open = editorNow() - t;
+  size_t bytes = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) bytes += E.row[j].size + 1;
+  editorRefreshScreen();
+
+  /* Search is typed into the prompt, which searches as it goes */
+  const char search[] = "\x06" BENCH_MARK "\r";
+  t = editorNow();
+  benchKeys(search, sizeof(search) - 1);
+  long long find = editorNow() - t;
+  int found = E.cy;
+
+  /* Scrolls down a screen at a time from the top */
+  editorSetCursor(0, 0);
+  editorRefreshScreen();
+  char pages[BENCH_PAGES * 4];
+  for (j = 0; j < BENCH_PAGES; j++) memcpy(&pages[j * 4], "\x1b[6~", 4);
+  t = editorNow();
+  benchKeys(pages, sizeof(pages));
+  long long scroll = editorNow() - t;
+
+  char typed[BENCH_TYPED];
+  for (j = 0; j < BENCH_TYPED; j++) typed[j] = "lorem ipsum "[j % 12];
+  editorSetCursor(0, 0);
+  editorRefreshScreen();
+  t = editorNow();
+  benchKeys(typed, sizeof(typed));
+  long long top = editorNow() - t;
+
+  editorSetCursor(E.numrows - 1, INT_MAX);
+  editorRefreshScreen();
+  t = editorNow();
+  benchKeys(typed, sizeof(typed));
+  long long bottom = editorNow() - t;
+
+  t = editorNow();
+  long long replaced = benchReplaceAll();
+  editorRefreshScreen();
+  long long replace = editorNow() - t;
+
+  /* Saves next to the corpus, so the corpus is the same next time */
+  char *saved = malloc(strlen(path) + 7);
+  sprintf(saved, "%s.saved", path);
+  free(E.filename);
+  E.filename = saved;
+  t = editorNow();
+  editorSave();
+  long long save = editorNow() - t;
+  unlink(saved);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("    {\"corpus\": \"%s\", \"bytes\": %zu, \"rows\": %d, \"found_row\": %d, "
+	 "\"replaced\": %lld,\n", path, bytes, E.numrows, found, replaced);
+  printf("     \"open_ms\": %.3f, \"search_ms\": %.3f, \"scroll_ms\": %.3f, "
+	 "\"type_top_ms\": %.3f, \"type_bottom_ms\": %.3f, \"replace_all_ms\": %.3f, "
+	 "\"save_ms\": %.3f,\n", open / 1e6, find / 1e6, scroll / 1e6, top / 1e6,
+	 bottom / 1e6, replace / 1e6, save / 1e6);
+  printf("     \"key_latency_p50_us\": %.1f, \"key_latency_p99_us\": %.1f, "
+	 "\"key_latency_max_us\": %.1f,\n", editorLatencyPercentile(0.5) / 1e3,
+	 editorLatencyPercentile(0.99) / 1e3, H.max / 1e3);
+  printf("     \"bytes_out\": %zu, \"peak_rss_kb\": %ld}", R.outbytes, ru.ru_maxrss);
+}
+
+int main(int argc, char *argv[]) {
+  const char *label = "";
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "--label") == 0) {
+    label = argv[2];
+    first = 3;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: spike-bench [--label LABEL] CORPUS...\n");
+    return 1;
+  }
+
+  printf("{\"label\": \"%s\", \"version\": \"%s\", \"results\": [\n", label, SPIKE_VERSION);
+  int j, failed = 0;
+  for (j = first; j < argc; j++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      benchCorpus(argv[j]);
+      fflush(stdout);
+      _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "spike-bench: %s failed\n", argv[j]);
+      printf("    null");
+      failed = 1;
+    }
+    printf(j + 1 < argc ? ",\n" : "\n");
+  }
+  printf("]}\n");
+  return failed;
+}